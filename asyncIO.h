@@ -0,0 +1,130 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Threads dedicated to blocking file operations, so that reads and
+ * writes overlap with the computations of the \ref ThreadPool instead of
+ * occupying its workers.
+ *
+ * Operations are submitted as with ThreadPool::submit and their result,
+ * or exception, is retrieved through the returned future. With a single
+ * thread (the default), operations run in submission order, so that
+ * successive writes to a file need no synchronization. The destructor
+ * completes the pending operations.
+ */
+class IOQueue {
+public:
+    explicit IOQueue(const unsigned int nbThreads = 1) {
+        for (unsigned int i = 0; i < std::max(1u, nbThreads); ++i) threads.emplace_back([this] { loop(); });
+    }
+
+    IOQueue(const IOQueue&) = delete;
+    IOQueue& operator=(const IOQueue&) = delete;
+
+    ~IOQueue() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& t : threads) t.join();
+    }
+
+    /// Enqueues \a f and returns a future on its result.
+    template <typename F>
+    auto submit(F&& f) -> std::future<decltype(f())> {
+        typedef decltype(f()) Result;
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(f));
+        auto future = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back([task] { (*task)(); });
+        }
+        cv.notify_one();
+        return future;
+    }
+
+private:
+    void loop() {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return stopping || !pending.empty(); });
+                if (pending.empty()) return;
+                task = std::move(pending.front());
+                pending.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> pending;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+};
+
+/**
+ * @brief Text file written through an \ref IOQueue: the text is buffered
+ * by the producer and handed over to the queue by blocks, so that the
+ * producer never waits on the disk. The queue must run its operations in
+ * order (a single thread).
+ */
+class AsyncFileWriter {
+public:
+    AsyncFileWriter(IOQueue& io, const std::string& filename, const size_t blockSize = 1 << 16)
+            : io(io), filename(filename), blockSize(blockSize), file(std::make_shared<std::ofstream>(filename, std::ios::binary)) {}
+
+    AsyncFileWriter& operator<<(const std::string& text) {
+        buffer += text;
+        if (buffer.size() >= blockSize) flush();
+        return *this;
+    }
+
+    /// Writes the buffered text and closes the file. @return a future
+    /// throwing std::runtime_error if the file could not be written.
+    std::future<void> close() {
+        flush();
+        auto file = this->file;
+        const auto filename = this->filename;
+        return io.submit([file, filename] {
+            file->close();
+            if (!*file) throw std::runtime_error("unable to write " + filename);
+        });
+    }
+
+private:
+    void flush() {
+        if (buffer.empty()) return;
+        auto file = this->file;
+        auto block = std::make_shared<std::string>(std::move(buffer));
+        buffer.clear();
+        io.submit([file, block] { file->write(block->data(), block->size()); });
+    }
+
+    IOQueue& io;
+    const std::string filename;
+    const size_t blockSize;
+    std::shared_ptr<std::ofstream> file;
+    std::string buffer;
+};
+
+/// @return the queue shared by the loaders and exporters, with one thread.
+inline IOQueue& sharedIOQueue() {
+    static IOQueue io;
+    return io;
+}
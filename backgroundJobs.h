@@ -0,0 +1,149 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "threadPool.h"
+
+/// Cancellation flag of a job, checked by the job between its stages, and
+/// by the curvature and sign loops before each chunk.
+class CancellationToken {
+public:
+    CancellationToken() : flag(std::make_shared<std::atomic<bool>>(false)) {}
+
+    void cancel() const { *flag = true; }
+    bool cancelled() const { return *flag; }
+
+    /// Throws \ref JobCancelled when the job was cancelled.
+    void check() const;
+
+private:
+    std::shared_ptr<std::atomic<bool>> flag;
+};
+
+/// Thrown by \ref CancellationToken::check to abandon a cancelled job.
+struct JobCancelled {};
+
+inline void CancellationToken::check() const {
+    if (cancelled()) throw JobCancelled();
+}
+
+/**
+ * @brief Runs jobs producing a Result in the background, one at a time,
+ * where only the latest submitted job matters: submitting a job cancels
+ * the running one and replaces the one waiting, if any. The owner (e.g.
+ * the UI thread) polls for the result of the latest job, so that it never
+ * blocks on a computation.
+ *
+ * Jobs run on a \ref ThreadPool and may use it for their own loops. They
+ * are run one at a time, so that they may share caches without locking.
+ * The class does not depend on the viewer and can be driven headlessly.
+ */
+template <typename Result>
+class LatestJobRunner {
+public:
+    typedef std::function<Result(const CancellationToken&)> Job;
+
+    explicit LatestJobRunner(ThreadPool& pool) : pool(pool) {}
+    LatestJobRunner(const LatestJobRunner&) = delete;
+    LatestJobRunner& operator=(const LatestJobRunner&) = delete;
+
+    /// Cancels the jobs and waits for the running one to stop.
+    ~LatestJobRunner() {
+        std::unique_lock<std::mutex> lock(mutex);
+        waiting = Job();
+        runningToken.cancel();
+        cv.wait(lock, [this] { return !running; });
+    }
+
+    /// Submits \a job, cancelling the previous ones.
+    void submit(Job job) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++generation;
+        if (running) {
+            runningToken.cancel();
+            waiting = std::move(job);
+            waitingGeneration = generation;
+        } else {
+            start(std::move(job), generation);
+        }
+    }
+
+    /// Moves the result of the latest job to \a result when it is done and
+    /// was not polled yet. @return true if so. Rethrows the exception of
+    /// the latest job, if it failed.
+    bool poll(Result& result) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (error) {
+            auto e = error;
+            error = nullptr;
+            std::rethrow_exception(e);
+        }
+        if (!hasResult) return false;
+        result = std::move(ready);
+        hasResult = false;
+        return true;
+    }
+
+    /// @return true while a job is running or waiting.
+    bool busy() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return running;
+    }
+
+private:
+    /// Starts \a job; the mutex is held.
+    void start(Job job, const size_t jobGeneration) {
+        running = true;
+        runningToken = CancellationToken();
+        const auto token = runningToken;
+        pool.submit([this, job, token, jobGeneration] { execute(job, token, jobGeneration); });
+    }
+
+    void execute(const Job& job, const CancellationToken& token, const size_t jobGeneration) {
+        Result result;
+        std::exception_ptr failure;
+        bool completed = false;
+        try {
+            result = job(token);
+            completed = !token.cancelled();
+        } catch (const JobCancelled&) {
+        } catch (...) {
+            failure = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        // Results of superseded jobs are dropped.
+        if (jobGeneration == generation) {
+            if (failure) {
+                error = failure;
+            } else if (completed) {
+                ready = std::move(result);
+                hasResult = true;
+            }
+        }
+        if (waiting) {
+            Job next = std::move(waiting);
+            waiting = Job();
+            start(std::move(next), waitingGeneration);
+        } else {
+            running = false;
+            cv.notify_all();
+        }
+    }
+
+    ThreadPool& pool;
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    size_t generation = 0;        ///< of the latest submitted job
+    bool running = false;
+    CancellationToken runningToken;
+    Job waiting;
+    size_t waitingGeneration = 0;
+    Result ready;
+    bool hasResult = false;
+    std::exception_ptr error;
+};
@@ -0,0 +1,358 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "threadPool.h"
+#include "volStream.h"
+
+/**
+ * @file brickVolume.h
+ *
+ * Chunked compressed volumes (`.bvol`): the voxels of a `.vol` volume cut
+ * into cubic bricks (64^3 by default, smaller at the upper borders), each
+ * compressed independently with the smallest of a few fast codecs:
+ *
+ * - Constant: a brick of one value, no payload;
+ * - BinaryRuns: a brick of two values, stored as the two values and the
+ *   lengths of the alternating runs, as LEB128 varints;
+ * - Runs: (value, length) pairs, lengths as LEB128 varints;
+ * - Packed: a palette of at most 16 values and 1, 2 or 4 bits per voxel;
+ * - Raw: one byte per voxel.
+ *
+ * Voxels are ordered x first, then y, then z, inside a brick as in the
+ * volume. The file is a header, the brick payloads, then the index of the
+ * bricks (offset, size, codec and range of values), so that any brick is
+ * decoded on its own: the bricks decode in parallel, and those whose range
+ * of values is irrelevant are skipped.
+ * Integers are stored little-endian.
+ */
+class BrickVolume {
+public:
+    enum class Codec : uint8_t { Constant, BinaryRuns, Runs, Packed, Raw };
+
+    struct Brick {
+        uint64_t offset; ///< in the payload
+        uint32_t size;
+        Codec codec;
+        uint8_t minValue, maxValue;
+    };
+
+    std::array<int, 3> sizes = {{0, 0, 0}};
+    int brickSize = 64;
+    std::vector<Brick> bricks; ///< x first, then y, then z
+    std::vector<unsigned char> payload;
+
+    /// @return the number of bricks along each axis.
+    std::array<int, 3> gridSizes() const {
+        return {{(sizes[0] + brickSize - 1) / brickSize, (sizes[1] + brickSize - 1) / brickSize,
+                 (sizes[2] + brickSize - 1) / brickSize}};
+    }
+
+    /// @return the box [lower, upper] (inclusive) of the voxels of brick \a b.
+    std::pair<std::array<int, 3>, std::array<int, 3>> brickBox(const size_t b) const {
+        const auto grid = gridSizes();
+        const std::array<size_t, 3> index = {{b % grid[0], b / grid[0] % grid[1], b / grid[0] / grid[1]}};
+        std::array<int, 3> lower, upper;
+        for (auto d = 0; d < 3; ++d) {
+            lower[d] = static_cast<int>(index[d]) * brickSize;
+            upper[d] = std::min(sizes[d], lower[d] + brickSize) - 1;
+        }
+        return {lower, upper};
+    }
+
+    /// Decodes the brick \a b into \a voxels, resized to the voxels of its box.
+    void decode(const size_t b, std::vector<unsigned char>& voxels) const {
+        const auto box = brickBox(b);
+        voxels.resize(static_cast<size_t>(box.second[0] - box.first[0] + 1) * (box.second[1] - box.first[1] + 1)
+                      * (box.second[2] - box.first[2] + 1));
+        const auto& brick = bricks[b];
+        const unsigned char* in = payload.data() + brick.offset;
+        const unsigned char* const inEnd = in + brick.size;
+        unsigned char* out = voxels.data();
+        unsigned char* const end = out + voxels.size();
+        // A corrupted payload leaves zeros: lengths are clamped to the brick.
+        const auto fillRun = [&](const unsigned char value, const size_t length) {
+            const auto last = out + std::min<size_t>(length, end - out);
+            std::fill(out, last, value);
+            out = last;
+        };
+        switch (brick.codec) {
+            case Codec::Constant:
+                fillRun(brick.minValue, voxels.size());
+                break;
+            case Codec::BinaryRuns: {
+                if (brick.size < 2) break;
+                const unsigned char values[2] = {in[0], in[1]};
+                in += 2;
+                for (int v = 0; out < end && in < inEnd; v = 1 - v) fillRun(values[v], readVarint(in, inEnd));
+                break;
+            }
+            case Codec::Runs:
+                while (out < end && in + 1 < inEnd) {
+                    const auto value = *in++;
+                    fillRun(value, readVarint(in, inEnd));
+                }
+                break;
+            case Codec::Packed: {
+                const int bits = brick.size > 0 ? in[0] : 0;
+                if ((bits != 1 && bits != 2 && bits != 4) || 1 + (1u << bits) + (voxels.size() * bits + 7) / 8 > brick.size) break;
+                const unsigned char* palette = in + 1;
+                const unsigned char* packed = palette + (1 << bits);
+                const unsigned mask = (1u << bits) - 1, perByte = 8 / bits;
+                for (; out < end; ++packed) {
+                    unsigned byte = *packed;
+                    for (unsigned k = 0; k < perByte && out < end; ++k, byte >>= bits) *out++ = palette[byte & mask];
+                }
+                break;
+            }
+            case Codec::Raw:
+                if (brick.size < voxels.size()) break;
+                std::copy(in, in + voxels.size(), out);
+                out = end;
+                break;
+        }
+        std::fill(out, end, 0);
+    }
+
+    /// Decodes the bricks \a selected in parallel, calling `f(b, voxels)`
+    /// concurrently for each of them.
+    template <typename F>
+    void decodeBricks(const std::vector<size_t>& selected, ThreadPool& pool, const F& f) const {
+        pool.parallelFor(0, selected.size(), 1, [&](size_t begin, size_t end) {
+            std::vector<unsigned char> voxels;
+            for (auto i = begin; i < end; ++i) {
+                decode(selected[i], voxels);
+                f(selected[i], voxels.data());
+            }
+        });
+    }
+
+    /// Compresses the payload of the `.vol` stream \a in, positioned after
+    /// its header, streaming it one layer of bricks at a time; the bricks
+    /// of a layer are encoded in parallel. @return false if it ends early.
+    static bool fromVol(std::istream& in, const VolHeader& header, ThreadPool& pool, BrickVolume& volume, const int brickSize = 64) {
+        volume = BrickVolume();
+        volume.sizes = header.sizes;
+        volume.brickSize = brickSize;
+        const auto grid = volume.gridSizes();
+        const size_t bricksPerLayer = static_cast<size_t>(grid[0]) * grid[1];
+        volume.bricks.resize(bricksPerLayer * grid[2]);
+        std::vector<std::vector<unsigned char>> encoded(bricksPerLayer);
+        return streamVolPlanes(in, header, 0, header.sizes[2], brickSize, [&](const int z0, const int, const unsigned char* data) {
+            const size_t first = bricksPerLayer * (z0 / brickSize);
+            pool.parallelFor(0, bricksPerLayer, 1, [&](size_t begin, size_t end) {
+                std::vector<unsigned char> voxels;
+                for (auto i = begin; i < end; ++i) {
+                    const auto box = volume.brickBox(first + i);
+                    voxels.clear();
+                    for (auto z = box.first[2]; z <= box.second[2]; ++z) {
+                        for (auto y = box.first[1]; y <= box.second[1]; ++y) {
+                            const auto row = data + header.planeSize() * (z - z0) + static_cast<size_t>(header.sizes[0]) * y;
+                            voxels.insert(voxels.end(), row + box.first[0], row + box.second[0] + 1);
+                        }
+                    }
+                    volume.bricks[first + i] = encode(voxels, encoded[i]);
+                }
+            });
+            for (size_t i = 0; i < bricksPerLayer; ++i) {
+                volume.bricks[first + i].offset = volume.payload.size();
+                volume.payload.insert(volume.payload.end(), encoded[i].begin(), encoded[i].end());
+            }
+        });
+    }
+
+    void write(std::ostream& out) const {
+        out.write("BVOL", 4);
+        writeInt<uint32_t>(out, 1);
+        for (const auto s : sizes) writeInt<int32_t>(out, s);
+        writeInt<int32_t>(out, brickSize);
+        writeInt<uint64_t>(out, payload.size());
+        out.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+        for (const auto& brick : bricks) {
+            writeInt<uint64_t>(out, brick.offset);
+            writeInt<uint32_t>(out, brick.size);
+            const unsigned char codec[4] = {static_cast<unsigned char>(brick.codec), brick.minValue, brick.maxValue, 0};
+            out.write(reinterpret_cast<const char*>(codec), 4);
+        }
+    }
+
+    /// @return false, with the reason in \a error, if \a in is not a valid `.bvol` stream.
+    bool read(std::istream& in, std::string& error) {
+        char magic[4];
+        uint32_t version = 0;
+        uint64_t payloadSize = 0;
+        in.read(magic, 4);
+        readInt(in, version);
+        if (!in || std::memcmp(magic, "BVOL", 4) != 0 || version != 1) {
+            error = "not a version 1 .bvol stream";
+            return false;
+        }
+        for (auto& s : sizes) readInt<int32_t>(in, s);
+        readInt<int32_t>(in, brickSize);
+        readInt(in, payloadSize);
+        if (!in || sizes[0] <= 0 || sizes[1] <= 0 || sizes[2] <= 0 || brickSize <= 0) {
+            error = "invalid sizes";
+            return false;
+        }
+        // Sizes are checked against the bytes left before anything is
+        // allocated, so that a corrupt header fails cleanly.
+        const auto grid = gridSizes();
+        const uint64_t nbBricks = static_cast<uint64_t>(grid[0]) * grid[1] * grid[2];
+        const uint64_t remaining = remainingBytes(in);
+        const uint64_t indexEntrySize = 16;
+        if (payloadSize > remaining || nbBricks > (remaining - payloadSize) / indexEntrySize) {
+            error = "truncated stream";
+            return false;
+        }
+        if (!readPayload(in, payloadSize)) {
+            error = "truncated stream";
+            return false;
+        }
+        bricks.resize(nbBricks);
+        for (auto& brick : bricks) {
+            unsigned char codec[4];
+            readInt(in, brick.offset);
+            readInt(in, brick.size);
+            in.read(reinterpret_cast<char*>(codec), 4);
+            brick.codec = static_cast<Codec>(codec[0]);
+            brick.minValue = codec[1];
+            brick.maxValue = codec[2];
+            if (in && ((brick.size > payloadSize || brick.offset > payloadSize - brick.size) || codec[0] > static_cast<unsigned char>(Codec::Raw))) {
+                error = "invalid brick index";
+                return false;
+            }
+        }
+        if (!in) {
+            error = "truncated stream";
+            return false;
+        }
+        return true;
+    }
+
+private:
+    /// @return the number of bytes left in \a in, or the largest value
+    /// when \a in cannot seek.
+    static uint64_t remainingBytes(std::istream& in) {
+        const auto position = in.tellg();
+        if (position < 0) return std::numeric_limits<uint64_t>::max();
+        in.seekg(0, std::ios::end);
+        const auto end = in.tellg();
+        in.seekg(position);
+        return end >= position ? static_cast<uint64_t>(end - position) : 0;
+    }
+
+    /// Reads \a size bytes of payload by bounded blocks, so that a stream
+    /// that cannot seek never makes it allocate more than it holds.
+    bool readPayload(std::istream& in, const uint64_t size) {
+        const uint64_t blockSize = uint64_t(1) << 24;
+        payload.clear();
+        while (payload.size() < size) {
+            const auto offset = payload.size();
+            const auto block = std::min(blockSize, size - offset);
+            payload.resize(offset + block);
+            in.read(reinterpret_cast<char*>(payload.data() + offset), block);
+            if (!in) return false;
+        }
+        return true;
+    }
+
+    /// Encodes \a voxels into \a out with the smallest codec. @return its
+    /// entry in the index, without offset.
+    static Brick encode(const std::vector<unsigned char>& voxels, std::vector<unsigned char>& out) {
+        Brick brick;
+        const auto range = std::minmax_element(voxels.begin(), voxels.end());
+        brick.minValue = *range.first;
+        brick.maxValue = *range.second;
+        out.clear();
+        if (brick.minValue == brick.maxValue) {
+            brick.codec = Codec::Constant;
+            brick.size = 0;
+            return brick;
+        }
+        bool used[256] = {};
+        size_t nbValues = 0, nbRuns = 0;
+        for (size_t i = 0; i < voxels.size(); ++i) {
+            if (!used[voxels[i]]) ++nbValues;
+            used[voxels[i]] = true;
+            if (i == 0 || voxels[i] != voxels[i - 1]) ++nbRuns;
+        }
+        std::vector<unsigned char> candidate;
+        brick.codec = Codec::Raw;
+        out = voxels;
+        const auto keep = [&](const Codec codec) {
+            if (candidate.size() >= out.size()) return;
+            out.swap(candidate);
+            brick.codec = codec;
+        };
+        if (nbValues <= 16) {
+            const int bits = nbValues <= 2 ? 1 : nbValues <= 4 ? 2 : 4;
+            unsigned char index[256] = {};
+            candidate.assign(1 + (1 << bits), 0);
+            candidate[0] = static_cast<unsigned char>(bits);
+            for (int v = 0, k = 0; v < 256; ++v) {
+                if (!used[v]) continue;
+                index[v] = static_cast<unsigned char>(k);
+                candidate[1 + k++] = static_cast<unsigned char>(v);
+            }
+            const size_t perByte = 8 / bits, start = candidate.size();
+            candidate.resize(start + (voxels.size() + perByte - 1) / perByte, 0);
+            for (size_t i = 0; i < voxels.size(); ++i) {
+                candidate[start + i / perByte] |= static_cast<unsigned char>(index[voxels[i]] << (bits * (i % perByte)));
+            }
+            keep(Codec::Packed);
+        }
+        // Runs are only tried when they may beat the codecs above.
+        if (nbRuns * (nbValues == 2 ? 1 : 2) < out.size()) {
+            candidate.clear();
+            if (nbValues == 2) candidate.insert(candidate.end(), {voxels[0], voxels[0] == brick.minValue ? brick.maxValue : brick.minValue});
+            for (size_t i = 0; i < voxels.size();) {
+                size_t j = i + 1;
+                while (j < voxels.size() && voxels[j] == voxels[i]) ++j;
+                if (nbValues != 2) candidate.push_back(voxels[i]);
+                writeVarint(candidate, j - i);
+                i = j;
+            }
+            keep(nbValues == 2 ? Codec::BinaryRuns : Codec::Runs);
+        }
+        brick.size = static_cast<uint32_t>(out.size());
+        return brick;
+    }
+
+    static void writeVarint(std::vector<unsigned char>& out, size_t v) {
+        for (; v >= 0x80; v >>= 7) out.push_back(static_cast<unsigned char>(v | 0x80));
+        out.push_back(static_cast<unsigned char>(v));
+    }
+
+    static size_t readVarint(const unsigned char*& in, const unsigned char* end) {
+        size_t v = 0;
+        for (int shift = 0; in < end && shift < 64; shift += 7) {
+            const auto byte = *in++;
+            v |= static_cast<size_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) break;
+        }
+        return v;
+    }
+
+    template <typename T>
+    static void writeInt(std::ostream& out, const T v) {
+        unsigned char bytes[sizeof(T)];
+        for (size_t i = 0; i < sizeof(T); ++i) bytes[i] = static_cast<unsigned char>(static_cast<uint64_t>(v) >> (8 * i));
+        out.write(reinterpret_cast<const char*>(bytes), sizeof(T));
+    }
+
+    template <typename T>
+    static void readInt(std::istream& in, T& v) {
+        unsigned char bytes[sizeof(T)] = {};
+        in.read(reinterpret_cast<char*>(bytes), sizeof(T));
+        uint64_t u = 0;
+        for (size_t i = 0; i < sizeof(T); ++i) u |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+        v = static_cast<T>(u);
+    }
+};
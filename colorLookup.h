@@ -0,0 +1,77 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+#include "DGtal/io/colormaps/GradientColorMap.h"
+
+#include "threadPool.h"
+
+/**
+ * @brief Colors of a color map sampled at evenly spaced values of
+ * [min, max], so that mapping a field is a table lookup per element
+ * instead of a gradient evaluation. Values outside the range get the
+ * color of the nearest bound. With few entries (e.g. 50), the colors are
+ * quantified as with DGtal's QuantifiedColorMap.
+ *
+ * Fields are mapped in parallel into a single buffer of RGB floats in
+ * [0,1], in the layout polyscope reads color quantities from.
+ */
+class ColorLookupTable {
+public:
+    typedef std::array<float, 3> RGB;
+
+    /// Samples \a colormap, a callable from double to DGtal::Color, at
+    /// \a nbEntries values of [\a minv, \a maxv].
+    template <typename ColorMap>
+    ColorLookupTable(const ColorMap& colormap, const double minv, const double maxv, const size_t nbEntries = 1024)
+            : minv(minv), entries(std::max<size_t>(nbEntries, 2)) {
+        const double step = (maxv - minv) / (entries.size() - 1);
+        scale = step > 0 ? 1. / step : 0.;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const DGtal::Color color = colormap(minv + i * step);
+            entries[i] = {{color.red() / 255.f, color.green() / 255.f, color.blue() / 255.f}};
+        }
+    }
+
+    /// Samples \a gcm over its own range.
+    explicit ColorLookupTable(const DGtal::GradientColorMap<double>& gcm, const size_t nbEntries = 1024)
+            : ColorLookupTable(gcm, gcm.min(), gcm.max(), nbEntries) {}
+
+    const RGB& operator()(const double v) const {
+        const double x = std::round((v - minv) * scale);
+        const size_t i = x > 0 ? std::min(static_cast<size_t>(x), entries.size() - 1) : 0;
+        return entries[i];
+    }
+
+    DGtal::Color color(const double v) const {
+        const auto& rgb = (*this)(v);
+        return DGtal::Color(static_cast<unsigned char>(std::lround(rgb[0] * 255)),
+                            static_cast<unsigned char>(std::lround(rgb[1] * 255)),
+                            static_cast<unsigned char>(std::lround(rgb[2] * 255)));
+    }
+
+    /// @return the colors of \a values, for the viewer.
+    std::vector<RGB> rgb(const std::vector<double>& values, ThreadPool& pool) const {
+        std::vector<RGB> colors(values.size());
+        pool.parallelFor(0, values.size(), 1 << 14, [&](size_t begin, size_t end) {
+            for (auto i = begin; i < end; ++i) colors[i] = (*this)(values[i]);
+        });
+        return colors;
+    }
+
+    /// @return the colors of \a values, for the mesh writers.
+    std::vector<DGtal::Color> colors(const std::vector<double>& values, ThreadPool& pool) const {
+        std::vector<DGtal::Color> colors(values.size());
+        pool.parallelFor(0, values.size(), 1 << 14, [&](size_t begin, size_t end) {
+            for (auto i = begin; i < end; ++i) colors[i] = color(values[i]);
+        });
+        return colors;
+    }
+
+private:
+    double minv;
+    double scale;
+    std::vector<RGB> entries;
+};
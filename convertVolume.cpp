@@ -0,0 +1,109 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "brickVolume.h"
+#include "threadPool.h"
+#include "volStream.h"
+
+/// Converts a `.vol` file to the chunked compressed `.bvol` format (see
+/// brickVolume.h), then reads both back to check the bricks and to
+/// compare the time of decoding and scanning them with the time of
+/// reading and scanning the `.vol`.
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <input.vol> <output.bvol> [brick size (64)]" << std::endl;
+        return 1;
+    }
+    const std::string input = argv[1], output = argv[2];
+    const int brickSize = argc > 3 ? std::atoi(argv[3]) : 64;
+    if (brickSize <= 0) {
+        std::cerr << "Invalid brick size " << argv[3] << std::endl;
+        return 1;
+    }
+    typedef std::chrono::steady_clock Clock;
+    const auto ms = [](const Clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    };
+    ThreadPool pool;
+
+    std::ifstream in(input, std::ios::binary);
+    VolHeader header;
+    std::string error;
+    if (!in) error = "cannot open";
+    if (!error.empty() || !readVolHeader(in, header, error)) {
+        std::cerr << input << ": " << error << std::endl;
+        return 1;
+    }
+    auto start = Clock::now();
+    BrickVolume volume;
+    if (!BrickVolume::fromVol(in, header, pool, volume, brickSize)) {
+        std::cerr << input << ": truncated payload" << std::endl;
+        return 1;
+    }
+    const auto encodeTime = ms(start);
+    std::ofstream out(output, std::ios::binary);
+    volume.write(out);
+    out.close();
+    if (!out) {
+        std::cerr << output << ": write failed" << std::endl;
+        return 1;
+    }
+    size_t perCodec[5] = {};
+    for (const auto& brick : volume.bricks) ++perCodec[static_cast<int>(brick.codec)];
+    const auto rawSize = header.planeSize() * header.sizes[2];
+    std::cout << input << ": " << volume.bricks.size() << " bricks of " << brickSize << "^3 (" << perCodec[0] << " constant, "
+              << perCodec[1] << " binary runs, " << perCodec[2] << " runs, " << perCodec[3] << " packed, " << perCodec[4]
+              << " raw), " << rawSize << " -> " << volume.payload.size() << " bytes of payload, encoded in " << encodeTime << " ms"
+              << std::endl;
+
+    // Reads back both files, from the page cache after the writes above.
+    start = Clock::now();
+    std::ifstream vin(input, std::ios::binary);
+    VolHeader vheader;
+    readVolHeader(vin, vheader, error);
+    std::vector<unsigned char> voxels(rawSize);
+    vin.read(reinterpret_cast<char*>(voxels.data()), voxels.size());
+    const auto volNonZero = voxels.size() - std::count(voxels.begin(), voxels.end(), 0);
+    const auto volTime = ms(start);
+    start = Clock::now();
+    std::ifstream bin(output, std::ios::binary);
+    BrickVolume decoded;
+    if (!decoded.read(bin, error)) {
+        std::cerr << output << ": " << error << std::endl;
+        return 1;
+    }
+    std::vector<size_t> all(decoded.bricks.size());
+    for (size_t b = 0; b < all.size(); ++b) all[b] = b;
+    std::vector<size_t> nonZero(all.size(), 0);
+    decoded.decodeBricks(all, pool, [&](const size_t b, const unsigned char* brick) {
+        const auto box = decoded.brickBox(b);
+        const size_t size = static_cast<size_t>(box.second[0] - box.first[0] + 1) * (box.second[1] - box.first[1] + 1) * (box.second[2] - box.first[2] + 1);
+        nonZero[b] = size - std::count(brick, brick + size, 0);
+    });
+    const auto bvolTime = ms(start);
+
+    std::vector<char> mismatch(all.size(), 0);
+    decoded.decodeBricks(all, pool, [&](const size_t b, const unsigned char* brick) {
+        const auto box = decoded.brickBox(b);
+        const size_t width = box.second[0] - box.first[0] + 1;
+        for (auto z = box.first[2]; z <= box.second[2]; ++z) {
+            for (auto y = box.first[1]; y <= box.second[1]; ++y, brick += width) {
+                const auto row = voxels.data() + header.planeSize() * z + static_cast<size_t>(header.sizes[0]) * y + box.first[0];
+                if (!std::equal(brick, brick + width, row)) mismatch[b] = 1;
+            }
+        }
+    });
+    if (std::count(mismatch.begin(), mismatch.end(), 1) > 0) {
+        std::cerr << output << ": decoded voxels differ from " << input << std::endl;
+        return 1;
+    }
+    std::cout << "Read and scanned " << input << " in " << volTime << " ms, decoded and scanned " << output << " in " << bvolTime
+              << " ms (" << volNonZero << " and " << std::accumulate(nonZero.begin(), nonZero.end(), size_t(0)) << " non-zero voxels)" << std::endl;
+    return 0;
+}
@@ -1,3 +1,13 @@
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
 #include <utility>
 
 #include "DGtal/base/Common.h"
@@ -11,6 +21,20 @@
 #include "polyscope/surface_mesh.h"
 
 #include "externalLibs/LinearKDTree.h"
+#include "asyncIO.h"
+#include "backgroundJobs.h"
+#include "brickVolume.h"
+#include "colorLookup.h"
+#include "featureExtraction.h"
+#include "imageComponents.h"
+#include "kernelTable.h"
+#include "monotonicArena.h"
+#include "numaTopology.h"
+#include "runLengthVolume.h"
+#include "taskGraph.h"
+#include "threadPool.h"
+#include "varifoldBatch.h"
+#include "volStream.h"
 
 using namespace DGtal;
 using namespace DGtal::Z3i;
@@ -18,6 +42,54 @@ typedef Shortcuts<KSpace>         SH3;
 typedef ShortcutsGeometry<KSpace> SHG3;
 typedef polyscope::SurfaceMesh PolyMesh;
 
+/**
+ * @brief Splits the command line into positional arguments (the
+ * program name being the first one) and `--key [value]` options.
+ * An option not followed by a value is stored with an empty value.
+ */
+class CommandLine {
+public:
+    CommandLine(int argc, char** argv) {
+        for (auto i = 0; i < argc; ++i) {
+            const std::string arg = argv[i];
+            if (arg.size() > 2 && arg.compare(0, 2, "--") == 0) {
+                const bool hasValue = i + 1 < argc && std::string(argv[i + 1]).compare(0, 2, "--") != 0;
+                options[arg.substr(2)] = hasValue ? argv[++i] : "";
+            } else {
+                positional.push_back(arg);
+            }
+        }
+    }
+
+    bool has(const std::string& key) const {
+        return options.count(key) > 0;
+    }
+
+    std::string get(const std::string& key, const std::string& def) const {
+        const auto it = options.find(key);
+        return it == options.end() ? def : it->second;
+    }
+
+    double getDouble(const std::string& key, const double def) const {
+        const auto it = options.find(key);
+        return it == options.end() || it->second.empty() ? def : std::atof(it->second.c_str());
+    }
+
+    /// @return the list of numbers given as a comma separated value of \a key.
+    std::vector<double> getDoubles(const std::string& key) const {
+        std::vector<double> values;
+        std::stringstream ss(get(key, ""));
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            if (!item.empty()) values.push_back(std::atof(item.c_str()));
+        }
+        return values;
+    }
+
+    std::vector<std::string> positional;
+    std::map<std::string, std::string> options;
+};
+
 std::pair<GradientColorMap<double>, GradientColorMap<double>> makeColorMap(double minv, double maxv) {
     if (maxv < 0) {
         GradientColorMap<double> gcm(minv, maxv);
@@ -42,16 +114,390 @@ std::pair<GradientColorMap<double>, GradientColorMap<double>> makeColorMap(doubl
     return {gcm, gcm2};
 }
 
-PolyMesh* registerSurface(const SH3::SurfaceMesh& surface, std::string name) {
-    std::vector<std::vector<size_t>> faces;
-    std::vector<RealPoint> positions;
-    auto smP = CountedPtr<SH3::SurfaceMesh>(new SH3::SurfaceMesh(surface));
+/// @return the lookup table of \ref makeColorMap: blue to white below 0,
+/// white to red to black above.
+ColorLookupTable makeColorLookupTable(double minv, double maxv) {
+    const auto colormap = makeColorMap(minv, maxv);
+    return ColorLookupTable([&](const double v) { return v < 0 ? colormap.first(v) : colormap.second(v); }, minv, maxv);
+}
+
+/// @return the binary image of the `.bvol` volume \a filename (see
+/// brickVolume.h), made of the voxels of value in (thresholdMin,
+/// thresholdMax], cropped as \ref loadBinaryImage. Bricks whose range of
+/// values is below or above the threshold are not decoded; the others
+/// are decoded in parallel into runs of foreground voxels. @return a null
+/// image if the file cannot be read or is corrupted.
+CountedPtr<SH3::BinaryImage> loadBrickImage(const std::string& filename, Parameters params, ThreadPool& pool = sharedThreadPool()) {
+    std::ifstream in(filename, std::ios::binary);
+    BrickVolume volume;
+    std::string error;
+    if (!in) error = "cannot open";
+    if (!error.empty() || !volume.read(in, error)) {
+        DGtal::trace.error() << filename << ": " << error << std::endl;
+        return CountedPtr<SH3::BinaryImage>();
+    }
+    const int thresholdMin = params["thresholdMin"].as_int(), thresholdMax = params["thresholdMax"].as_int();
+    const auto isForeground = [=](const unsigned char v) { return v > thresholdMin && v <= thresholdMax; };
+    std::vector<size_t> selected;
+    for (size_t b = 0; b < volume.bricks.size(); ++b) {
+        const auto& brick = volume.bricks[b];
+        if (brick.maxValue > thresholdMin && brick.minValue <= thresholdMax) selected.push_back(b);
+    }
+    std::vector<std::vector<VoxelRun>> brickRuns(volume.bricks.size());
+    volume.decodeBricks(selected, pool, [&](const size_t b, const unsigned char* voxels) {
+        const auto box = volume.brickBox(b);
+        for (auto z = box.first[2]; z <= box.second[2]; ++z) {
+            for (auto y = box.first[1]; y <= box.second[1]; ++y) {
+                for (auto x = box.first[0]; x <= box.second[0]; ++x, ++voxels) {
+                    if (!isForeground(*voxels)) continue;
+                    const int x0 = x;
+                    while (x < box.second[0] && isForeground(voxels[1])) ++x, ++voxels;
+                    brickRuns[b].push_back({x0, x + 1, y, z});
+                }
+            }
+        }
+    });
+    VoxelBox box;
+    for (const auto& runs : brickRuns) {
+        for (const auto& run : runs) {
+            VoxelBox runBox;
+            runBox.lower = {{run.x0, run.y, run.z}};
+            runBox.upper = {{run.x1 - 1, run.y, run.z}};
+            box.extend(runBox);
+        }
+    }
+    if (box.empty()) box.upper = box.lower;
+
+    const Point lower(box.lower[0] - 1, box.lower[1] - 1, box.lower[2] - 1), upper(box.upper[0] + 1, box.upper[1] + 1, box.upper[2] + 1);
+    auto image = CountedPtr<SH3::BinaryImage>(new SH3::BinaryImage(SH3::Domain(lower, upper)));
+    for (const auto& runs : brickRuns) {
+        for (const auto& run : runs) {
+            for (auto x = run.x0; x < run.x1; ++x) image->setValue(Point(x, run.y, run.z), true);
+        }
+    }
+    DGtal::trace.info() << "Decoded " << selected.size() << " of " << volume.bricks.size() << " bricks of " << filename << ", cropped to "
+                        << upper[0] - lower[0] + 1 << "x" << upper[1] - lower[1] + 1 << "x" << upper[2] - lower[2] + 1 << " voxels" << std::endl;
+    return image;
+}
+
+/// @return the binary image of the volume \a filename, made of the voxels
+/// of value in (thresholdMin, thresholdMax] (see SH3::makeBinaryImage),
+/// cropped to the bounding box of these voxels plus a one-voxel border.
+/// Raw `.vol` files are streamed twice, to find the box and then to fill
+/// the cropped image, so that the full domain is never allocated; other
+/// inputs go through SH3::makeBinaryImage, except `.bvol` volumes (see
+/// \ref loadBrickImage).
+CountedPtr<SH3::BinaryImage> loadBinaryImage(const std::string& filename, Parameters params, ThreadPool& pool = sharedThreadPool()) {
+    if (filename.size() > 5 && filename.compare(filename.size() - 5, 5, ".bvol") == 0) return loadBrickImage(filename, params, pool);
+    const bool isVol = filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".vol") == 0;
+    std::ifstream in(filename, std::ios::binary);
+    VolHeader header;
+    std::string error;
+    if (!isVol || params["noise"].as_double() > 0. || !in || !readVolHeader(in, header, error)) {
+        if (!error.empty()) DGtal::trace.warning() << filename << ": " << error << ", read without cropping" << std::endl;
+        return SH3::makeBinaryImage(filename, params);
+    }
+    const int thresholdMin = params["thresholdMin"].as_int(), thresholdMax = params["thresholdMax"].as_int();
+    const auto isForeground = [=](const unsigned char v) { return v > thresholdMin && v <= thresholdMax; };
+    const auto payload = in.tellg();
+    VoxelBox box;
+    if (!foregroundBox(in, header, isForeground, pool, box)) {
+        DGtal::trace.warning() << filename << ": truncated payload, read without cropping" << std::endl;
+        return SH3::makeBinaryImage(filename, params);
+    }
+    if (box.empty()) box.upper = box.lower; // an empty image of one voxel
+
+    const Point lower(box.lower[0] - 1, box.lower[1] - 1, box.lower[2] - 1), upper(box.upper[0] + 1, box.upper[1] + 1, box.upper[2] + 1);
+    auto image = CountedPtr<SH3::BinaryImage>(new SH3::BinaryImage(SH3::Domain(lower, upper)));
+    in.clear();
+    in.seekg(payload + static_cast<std::streamoff>(header.planeSize() * box.lower[2]));
+    streamVolPlanes(in, header, box.lower[2], box.upper[2] + 1, 16, [&](const int z0, const int z1, const unsigned char* data) {
+        for (auto z = z0; z < z1; ++z) {
+            for (auto y = box.lower[1]; y <= box.upper[1]; ++y) {
+                const auto row = data + header.planeSize() * (z - z0) + static_cast<size_t>(header.sizes[0]) * y;
+                for (auto x = box.lower[0]; x <= box.upper[0]; ++x) {
+                    if (isForeground(row[x])) image->setValue(Point(x, y, z), true);
+                }
+            }
+        }
+    });
+    DGtal::trace.info() << "Cropped " << filename << " from " << header.sizes[0] << "x" << header.sizes[1] << "x" << header.sizes[2]
+                        << " to " << upper[0] - lower[0] + 1 << "x" << upper[1] - lower[1] + 1 << "x" << upper[2] - lower[2] + 1
+                        << " voxels" << std::endl;
+    return image;
+}
+
+/// @return one image per 6-connected component of the foreground of \a
+/// image with at least \a minVoxels voxels, largest first, each on the
+/// bounding box of its component plus a one-voxel border.
+std::vector<CountedPtr<SH3::BinaryImage>> splitComponents(const CountedPtr<SH3::BinaryImage>& image, const size_t minVoxels = 1,
+                                                          ThreadPool& pool = sharedThreadPool()) {
+    const auto lower = image->domain().lowerBound(), upper = image->domain().upperBound();
+    const SH3::BinaryImage& voxels = *image;
+    const auto components = labelComponents({{lower[0], lower[1], lower[2]}}, {{upper[0], upper[1], upper[2]}},
+                                            [&](int x, int y, int z) { return voxels(Point(x, y, z)); }, pool, minVoxels);
+    std::vector<CountedPtr<SH3::BinaryImage>> images(components.size());
+    pool.parallelFor(0, components.size(), 1, [&](size_t begin, size_t end) {
+        for (auto c = begin; c < end; ++c) {
+            const auto& component = components[c];
+            const Point low(component.lower[0] - 1, component.lower[1] - 1, component.lower[2] - 1);
+            const Point up(component.upper[0] + 1, component.upper[1] + 1, component.upper[2] + 1);
+            images[c] = CountedPtr<SH3::BinaryImage>(new SH3::BinaryImage(SH3::Domain(low, up)));
+            for (const auto& run : component.runs) {
+                for (auto x = run.x0; x < run.x1; ++x) images[c]->setValue(Point(x, run.y, run.z), true);
+            }
+        }
+    });
+    DGtal::trace.info() << components.size() << " components";
+    if (!components.empty()) DGtal::trace.info() << ", largest of " << components[0].nbVoxels << " voxels";
+    DGtal::trace.info() << std::endl;
+    return images;
+}
 
+/// Reads the volume \a filename as runs of the voxels of value in
+/// (thresholdMin, thresholdMax], streaming it by blocks of planes.
+/// @return false if \a filename is not a raw `.vol` file.
+bool loadRunLengthVolume(const std::string& filename, Parameters params, RunLengthVolume& volume, ThreadPool& pool = sharedThreadPool()) {
+    const bool isVol = filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".vol") == 0;
+    std::ifstream in(filename, std::ios::binary);
+    VolHeader header;
+    std::string error;
+    if (!isVol || !in || !readVolHeader(in, header, error)) {
+        DGtal::trace.warning() << filename << ": " << (error.empty() ? "not a .vol file" : error) << std::endl;
+        return false;
+    }
+    const int thresholdMin = params["thresholdMin"].as_int(), thresholdMax = params["thresholdMax"].as_int();
+    const auto isForeground = [=](const unsigned char v) { return v > thresholdMin && v <= thresholdMax; };
+    if (!RunLengthVolume::fromVol(in, header, isForeground, pool, volume)) {
+        DGtal::trace.warning() << filename << ": truncated payload" << std::endl;
+        return false;
+    }
+    DGtal::trace.info() << filename << ": " << volume.nbVoxels() << " voxels in " << volume.nbRuns() << " runs, "
+                        << volume.memory() / 1024 << " KiB instead of " << header.planeSize() * header.sizes[2] / 8192
+                        << " KiB as a dense bit image" << std::endl;
+    return true;
+}
+
+/// @return the primal surface mesh of the boundary of \a volume: one quad
+/// per surfel, oriented outward, on the voxel corners shared by the
+/// surfels, with the coordinates of SH3::makePrimalSurfaceMesh (voxels
+/// centered on integer points). The corners are gathered and indexed in
+/// parallel by sorting their packed coordinates.
+SH3::SurfaceMesh makeSurfaceMesh(const RunLengthVolume& volume, ThreadPool& pool = sharedThreadPool()) {
+    const auto surfels = volume.surfels(pool);
+    const auto lower = volume.lowerBound();
+    // Corner (x, y, z) of the voxels, shifted to be non negative, packed
+    // on 21 bits per coordinate.
+    const auto pack = [&](const std::array<int, 3>& c) {
+        return static_cast<uint64_t>(c[0] - lower[0]) | static_cast<uint64_t>(c[1] - lower[1]) << 21
+               | static_cast<uint64_t>(c[2] - lower[2]) << 42;
+    };
+    std::vector<uint64_t> corners(4 * surfels.size());
+    pool.parallelFor(0, surfels.size(), 4096, [&](size_t begin, size_t end) {
+        for (auto s = begin; s < end; ++s) {
+            const auto& surfel = surfels[s];
+            const int a = surfel.axis, b = (a + 1) % 3, c = (a + 2) % 3;
+            std::array<int, 3> corner = {{surfel.x, surfel.y, surfel.z}};
+            corner[a] += surfel.positive ? 1 : 0;
+            // Counterclockwise around +a: reversed on the negative side.
+            const int db[4] = {0, 1, 1, 0}, dc[4] = {0, 0, 1, 1};
+            for (auto k = 0; k < 4; ++k) {
+                const auto j = surfel.positive ? k : 3 - k;
+                auto p = corner;
+                p[b] += db[j];
+                p[c] += dc[j];
+                corners[4 * s + k] = pack(p);
+            }
+        }
+    });
+    std::vector<uint64_t> pointels(corners);
+    std::sort(pointels.begin(), pointels.end());
+    pointels.erase(std::unique(pointels.begin(), pointels.end()), pointels.end());
+
+    SH3::RealPoints vertices(pointels.size());
+    std::vector<SH3::SurfaceMesh::Vertices> faces(surfels.size(), SH3::SurfaceMesh::Vertices(4));
+    pool.parallelFor(0, pointels.size(), 4096, [&](size_t begin, size_t end) {
+        const uint64_t mask = (uint64_t(1) << 21) - 1;
+        for (auto v = begin; v < end; ++v) {
+            const auto p = pointels[v];
+            vertices[v] = RealPoint(double(p & mask) + lower[0] - 0.5, double(p >> 21 & mask) + lower[1] - 0.5,
+                                    double(p >> 42) + lower[2] - 0.5);
+        }
+    });
+    pool.parallelFor(0, surfels.size(), 4096, [&](size_t begin, size_t end) {
+        for (auto s = begin; s < end; ++s) {
+            for (auto k = 0; k < 4; ++k) {
+                faces[s][k] = std::lower_bound(pointels.begin(), pointels.end(), corners[4 * s + k]) - pointels.begin();
+            }
+        }
+    });
+    SH3::SurfaceMesh mesh;
+    mesh.init(vertices.cbegin(), vertices.cend(), faces.cbegin(), faces.cend());
+    return mesh;
+}
+
+/// Registers \a surface in the viewer. The faces of digital surfaces are
+/// quads: their indices are gathered in parallel into one flat buffer,
+/// and the positions are read in place; other meshes go through one
+/// index vector per face.
+PolyMesh* registerSurface(const SH3::SurfaceMesh& surface, std::string name, ThreadPool& pool = sharedThreadPool()) {
+    std::vector<std::array<size_t, 4>> quads(surface.nbFaces());
+    std::atomic<bool> onlyQuads(true);
+    pool.parallelFor(0, surface.nbFaces(), 1 << 14, [&](size_t begin, size_t end) {
+        for (auto f = begin; f < end; ++f) {
+            const auto& vertices = surface.incidentVertices(f);
+            if (vertices.size() != 4) {
+                onlyQuads = false;
+                return;
+            }
+            std::copy(vertices.begin(), vertices.end(), quads[f].begin());
+        }
+    });
+    if (onlyQuads) return polyscope::registerSurfaceMesh(std::move(name), surface.positions(), quads);
+
+    quads = std::vector<std::array<size_t, 4>>();
+    const ArenaScope scope;
+    ArenaVector<ArenaVector<size_t>> faces(ArenaAllocator<ArenaVector<size_t>>(scope.arena));
+    faces.reserve(surface.nbFaces());
     for (auto f = 0; f < surface.nbFaces(); ++f) {
-        faces.push_back(surface.incidentVertices(f));
+        const auto& vertices = surface.incidentVertices(f);
+        faces.emplace_back(vertices.begin(), vertices.end(), ArenaAllocator<size_t>(scope.arena));
+    }
+    return polyscope::registerSurfaceMesh(std::move(name), surface.positions(), faces);
+}
+
+/**
+ * Display mesh decimated by vertex clustering: the vertices of a mesh are
+ * merged per cell of a grid of side cellSize, and its faces become the
+ * triangles spanning three distinct clusters. Fields of the full mesh
+ * are aggregated per cluster, from the positions of their elements
+ * (faces or vertices), then per triangle; the full mesh keeps the full
+ * resolution fields.
+ */
+struct ClusteredMesh {
+    std::vector<RealPoint> positions;             ///< mean position of each cluster
+    std::vector<std::array<size_t, 3>> triangles; ///< indices of clusters
+    RealPoint lower;
+    double cellSize;
+    std::unordered_map<uint64_t, size_t> clusterOfCell;
+
+    uint64_t cellOf(const RealPoint& p) const {
+        uint64_t key = 0;
+        for (auto d = 0; d < 3; ++d) {
+            key = (key << 21) | (static_cast<uint64_t>(std::floor((p[d] - lower[d]) / cellSize)) & ((1 << 21) - 1));
+        }
+        return key;
+    }
+
+    /// @return the cluster of the cell containing \a p, or the number of
+    /// clusters if the cell is empty.
+    size_t clusterOf(const RealPoint& p) const {
+        const auto it = clusterOfCell.find(cellOf(p));
+        return it == clusterOfCell.end() ? positions.size() : it->second;
+    }
+
+    /// @return the mean per triangle of the \a values of elements at
+    /// \a elementPositions: the mean of the means of its clusters.
+    template <typename T>
+    std::vector<T> aggregate(const std::vector<RealPoint>& elementPositions, const std::vector<T>& values, ThreadPool& pool) const {
+        std::vector<size_t> clusters(elementPositions.size());
+        pool.parallelFor(0, elementPositions.size(), 4096, [&](size_t begin, size_t end) {
+            for (auto i = begin; i < end; ++i) clusters[i] = clusterOf(elementPositions[i]);
+        });
+        // Elements of each cluster, by counting sort. Elements in empty
+        // cells (cluster positions.size()) get a last slot, never read.
+        std::vector<size_t> offsets(positions.size() + 3, 0);
+        for (const auto c : clusters) ++offsets[c + 2];
+        std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+        std::vector<size_t> elements(clusters.size());
+        for (size_t i = 0; i < clusters.size(); ++i) elements[offsets[clusters[i] + 1]++] = i;
+        std::vector<T> means(positions.size(), T());
+        std::vector<char> hasValue(positions.size(), 0);
+        pool.parallelFor(0, positions.size(), 1024, [&](size_t begin, size_t end) {
+            for (auto c = begin; c < end; ++c) {
+                if (offsets[c] == offsets[c + 1]) continue;
+                T sum = T();
+                for (auto k = offsets[c]; k < offsets[c + 1]; ++k) sum += values[elements[k]];
+                means[c] = sum / static_cast<double>(offsets[c + 1] - offsets[c]);
+                hasValue[c] = 1;
+            }
+        });
+        std::vector<T> result(triangles.size(), T());
+        pool.parallelFor(0, triangles.size(), 4096, [&](size_t begin, size_t end) {
+            for (auto t = begin; t < end; ++t) {
+                T sum = T();
+                auto count = 0;
+                for (const auto c : triangles[t]) {
+                    if (!hasValue[c]) continue;
+                    sum += means[c];
+                    ++count;
+                }
+                if (count > 0) result[t] = sum / static_cast<double>(count);
+            }
+        });
+        return result;
+    }
+};
+
+/// @return the clustering of \a mesh on a grid of side \a cellSize.
+ClusteredMesh clusterMesh(const SH3::SurfaceMesh& mesh, const double cellSize, ThreadPool& pool = sharedThreadPool()) {
+    ClusteredMesh clustered;
+    clustered.cellSize = cellSize;
+    const auto& points = mesh.positions();
+    clustered.lower = points.empty() ? RealPoint(0, 0, 0) : points[0];
+    for (const auto& p : points) clustered.lower = clustered.lower.inf(p);
+    std::vector<uint64_t> cells(points.size());
+    pool.parallelFor(0, points.size(), 4096, [&](size_t begin, size_t end) {
+        for (auto v = begin; v < end; ++v) cells[v] = clustered.cellOf(points[v]);
+    });
+    std::vector<size_t> clusterOfVertex(points.size());
+    std::vector<size_t> counts;
+    for (size_t v = 0; v < points.size(); ++v) {
+        const auto inserted = clustered.clusterOfCell.emplace(cells[v], clustered.positions.size());
+        if (inserted.second) {
+            clustered.positions.push_back(RealPoint(0, 0, 0));
+            counts.push_back(0);
+        }
+        const auto c = inserted.first->second;
+        clusterOfVertex[v] = c;
+        clustered.positions[c] += points[v];
+        ++counts[c];
     }
-    positions = surface.positions();
-    return polyscope::registerSurfaceMesh(std::move(name), positions, faces);
+    for (size_t c = 0; c < counts.size(); ++c) clustered.positions[c] /= static_cast<double>(counts[c]);
+
+    // Faces spanning at least three clusters, as fans of triangles; each
+    // triangle is kept once.
+    std::vector<std::array<size_t, 4>> polygons(mesh.nbFaces());
+    std::vector<char> sides(mesh.nbFaces());
+    pool.parallelFor(0, mesh.nbFaces(), 4096, [&](size_t begin, size_t end) {
+        for (auto f = begin; f < end; ++f) {
+            char n = 0;
+            for (const auto v : mesh.incidentVertices(f)) {
+                const auto c = clusterOfVertex[v];
+                if (n < 4 && (n == 0 || (polygons[f][n - 1] != c && polygons[f][0] != c))) polygons[f][n++] = c;
+            }
+            sides[f] = n;
+        }
+    });
+    std::vector<std::pair<std::array<size_t, 3>, std::array<size_t, 3>>> keyed;
+    for (size_t f = 0; f < polygons.size(); ++f) {
+        for (auto k = 1; k + 1 < sides[f]; ++k) {
+            const std::array<size_t, 3> triangle = {{polygons[f][0], polygons[f][k], polygons[f][k + 1]}};
+            if (triangle[0] == triangle[2]) continue;
+            auto key = triangle;
+            std::sort(key.begin(), key.end());
+            keyed.emplace_back(key, triangle);
+        }
+    }
+    std::sort(keyed.begin(), keyed.end());
+    for (size_t i = 0; i < keyed.size(); ++i) {
+        if (i == 0 || keyed[i].first != keyed[i - 1].first) clustered.triangles.push_back(keyed[i].second);
+    }
+    return clustered;
+}
+
+PolyMesh* registerClusteredMesh(const ClusteredMesh& mesh, std::string name) {
+    return polyscope::registerSurfaceMesh(std::move(name), mesh.positions, mesh.triangles);
 }
 
 class Varifold {
@@ -68,15 +514,26 @@ public:
 typedef enum {
     Linear,
     Polynomial,
-    Exponential
+    Exponential,
+    TabulatedExponential
 } DistributionType;
 
 class RadialDistance {
 public:
-    RadialDistance(): center(0,0,0), radius(1) {};
-    RadialDistance(const RealPoint& center, const double radius, const DistributionType& distribution)
-            : center(center), radius(radius) {
+    RadialDistance(): center(0,0,0), radius(1), a(10.0) {};
+    RadialDistance(const RealPoint& center, const double radius, const DistributionType& distribution, const double a = 10.0)
+            : center(center), radius(radius), a(a) {
         switch (distribution) {
+            case DistributionType::TabulatedExponential: {
+                const auto table = &ExponentialKernelTable::get(a);
+                measureFunction = [table](double dRatio, double a) {
+                    return table->value(dRatio*dRatio);
+                };
+                measureFunctionDerivate = [table](double dRatio, double a) {
+                    return table->derivative(dRatio*dRatio, dRatio);
+                };
+                break;
+            }
             case DistributionType::Exponential:
                 measureFunction = [](double dRatio, double a) {
                     return exp(-a/(1-dRatio*dRatio));
@@ -106,12 +563,20 @@ public:
     }
     RealPoint center;
     double radius;
+    double a; ///< parameter of the exponential kernels
     std::function<double(double, double)> measureFunction;
     std::function<double(double, double)> measureFunctionDerivate;
 
     std::vector<std::pair<double,double>> operator()(const SH3::RealPoints& mesh, const std::vector<size_t>& poi) const {
         std::vector<std::pair<double,double>> wf;
-        double a = 10.0;
+        (*this)(mesh, poi, wf);
+        return wf;
+    }
+
+    /// Outputs the weights of the points \a poi in \a wf, cleared first.
+    template <typename Indices, typename Output>
+    void operator()(const SH3::RealPoints& mesh, const Indices& poi, Output& wf) const {
+        wf.clear();
         for (const auto& b : poi) {
             // If the face is inside the radius, compute the weight
             const auto d = (mesh[b] - center).norm();
@@ -121,7 +586,6 @@ public:
                 wf.emplace_back(0., 0.);
             }
         }
-        return wf;
     }
 };
 
@@ -133,68 +597,193 @@ typedef enum {
     VertexInterpolation
 } Method;
 
+typedef enum {
+    FullPrecisionNormals,
+    Octahedral32Normals,
+    Octahedral48Normals
+} NormalEncoding;
+
+/// Tuning options of the curvature engine.
+struct VarifoldOptions {
+    double kernelA = 10.0; ///< parameter of the exponential kernels
+    NormalEncoding normalEncoding = NormalEncoding::FullPrecisionNormals; ///< storage of normals in the inner loop
+    bool symmetricPairs = false; ///< evaluates distances and kernels once per unordered pair
+    bool singlePrecision = false; ///< computes the batched lanes in float
+    size_t grain = 256; ///< elements per chunk of the parallel curvature loop
+    CancellationToken cancellation; ///< checked by the curvature loops before each chunk
+};
+
 RealVector projection(const RealVector& toProject, const RealVector& planeNormal) {
     return toProject - planeNormal * (toProject.dot(planeNormal)/planeNormal.squaredNorm());
 }
 
-std::vector<RealVector> computeLocalCurvature(const CountedPtr<SH3::BinaryImage>& bimage, const CountedPtr<SH3::DigitalSurface>& surface, const double cRadius, const DistributionType cDistribType, const Method method) {
-    std::vector<RealVector> curvatures;
-    const CountedPtr<SH3::SurfaceMesh> pSurface = SH3::makePrimalSurfaceMesh(surface);
-    RadialDistance rd;
-    std::vector<std::pair<double, double>> weights;
-    RealVector tmpSumTop;
-    double tmpSumBottom;
-    RealVector tmpVector;
+/**
+ * @brief Sparse face-vertex incidence operator, normalized per face, that
+ * maps values given at the vertices of a mesh to its faces by averaging
+ * the values of the incident vertices. It is stored in CSR form.
+ */
+class FaceVertexAverager {
+public:
+    explicit FaceVertexAverager(const SH3::SurfaceMesh& mesh) {
+        offsets.reserve(mesh.nbFaces() + 1);
+        offsets.push_back(0);
+        for (auto f = 0; f < mesh.nbFaces(); ++f) {
+            const auto& vertices = mesh.incidentVertices(f);
+            for (const auto v : vertices) {
+                columns.push_back(v);
+                weights.push_back(1.0 / vertices.size());
+            }
+            offsets.push_back(columns.size());
+        }
+    }
+
+    /// @return the face values obtained from the given vertex values.
+    template <typename T>
+    std::vector<T> apply(const std::vector<T>& vertexValues, ThreadPool& pool = sharedThreadPool()) const {
+        std::vector<T> faceValues(offsets.size() - 1);
+        pool.parallelFor(0, faceValues.size(), 4096, [&](size_t i, size_t j) {
+            for (auto f = i; f < j; ++f) {
+                T value = T();
+                for (auto k = offsets[f]; k < offsets[f + 1]; ++k) {
+                    value += vertexValues[columns[k]] * weights[k];
+                }
+                faceValues[f] = value;
+            }
+        });
+        return faceValues;
+    }
 
-    auto positions = SH3::RealPoints();
+private:
+    std::vector<size_t> offsets;
+    std::vector<size_t> columns;
+    std::vector<double> weights;
+};
 
-    auto normals = SH3::RealVectors();
+/**
+ * @brief Per-element mixture of the six trivial normals (+x,-x,+y,-y,+z,-z)
+ * stored as 6 floats. The tangent projector of the mixture is the
+ * weighted sum of the projectors of the trivial planes, I - diag(p) with
+ * p the weight of each axis, so projecting only scales each component:
+ * the curvature loops read the three float weights p (see \ref
+ * ElementArrays), never a full projector.
+ */
+struct TrivialNormalMixture {
+    std::array<float, 6> weights;
 
-    unsigned long nbElements;
+    /// @return the mean normal of the mixture.
+    RealVector meanNormal() const {
+        return RealVector(weights[0] - weights[1], weights[2] - weights[3], weights[4] - weights[5]);
+    }
 
-    pSurface->computeFaceNormalsFromPositions();
-    pSurface->computeVertexNormalsFromFaceNormals();
+    /// @return the weight p of the axis \a k, the projector being I - diag(p).
+    float axisWeight(const int k) const {
+        return weights[2 * k] + weights[2 * k + 1];
+    }
+};
 
-    switch (method) {
-        case TrivialNormalFaceCentroid:
-            nbElements = pSurface->nbFaces();
-            for (auto f = 0; f < nbElements; ++f) {
-                positions.push_back(pSurface->faceCentroid(f));
-                normals.push_back(pSurface->faceNormal(f));
-            }
-            break;
-        case DualNormalVertexPosition:
-            nbElements = pSurface->nbVertices();
-            for (auto v = 0; v < nbElements; ++v) {
-                positions.push_back(pSurface->position(v));
-                normals.push_back(pSurface->vertexNormal(v));
-            }
-            break;
-        case CorrectedNormalFaceCentroid:
-            nbElements = pSurface->nbFaces();
-            normals = SHG3::getIINormalVectors(bimage, SH3::getSurfelRange(surface), SHG3::defaultParameters()("verbose", 0));
-            for (auto f = 0; f < nbElements; ++f) {
-                positions.push_back(pSurface->faceCentroid(f));
+/// Builds, for each face of \a mesh (whose face normals are computed),
+/// the mixture of the trivial normals of the faces sharing a vertex with
+/// it (itself included), weighted by their frequencies.
+std::vector<TrivialNormalMixture> computeTrivialNormalMixtures(const SH3::SurfaceMesh& mesh, ThreadPool& pool = sharedThreadPool()) {
+    std::vector<TrivialNormalMixture> mixtures(mesh.nbFaces());
+    const auto trivialIndex = [&mesh](const size_t f) {
+        const auto& n = mesh.faceNormal(f);
+        auto k = 0;
+        for (auto i = 1; i < 3; ++i) {
+            if (std::fabs(n[i]) > std::fabs(n[k])) k = i;
+        }
+        return 2 * k + (n[k] < 0 ? 1 : 0);
+    };
+    pool.parallelFor(0, mesh.nbFaces(), 4096, [&](size_t i, size_t j) {
+        std::vector<size_t> ring;
+        for (auto f = i; f < j; ++f) {
+            ring.clear();
+            for (const auto v : mesh.incidentVertices(f)) {
+                const auto& faces = mesh.incidentFaces(v);
+                ring.insert(ring.end(), faces.begin(), faces.end());
             }
-            break;
-        default:
-            return curvatures;
+            std::sort(ring.begin(), ring.end());
+            ring.erase(std::unique(ring.begin(), ring.end()), ring.end());
+            auto& weights = mixtures[f].weights;
+            weights.fill(0.f);
+            for (const auto g : ring) weights[trivialIndex(g)] += 1.f;
+            for (auto& w : weights) w /= ring.size();
+        }
+    });
+    return mixtures;
+}
+
+/**
+ * @brief LinearKDTree built in parallel: the top levels are split level
+ * by level, the splits of a level running concurrently, then the
+ * remaining subtrees are built independently. The tree is the same as
+ * the one built sequentially, and its index order (\c _indices) is a
+ * spatially coherent order of the points.
+ */
+struct ParallelKDTree : public LinearKDTree<RealPoint, 3> {
+    ParallelKDTree(const SH3::RealPoints& points, ThreadPool& pool = sharedThreadPool()) {
+        struct Range {
+            Index i, j;
+            int a;
+        };
+        _points = points;
+        _indices.resize(points.size());
+        std::iota(_indices.begin(), _indices.end(), 0);
+        std::vector<Range> ranges{{0, points.size(), 0}};
+        while (ranges.size() < 8 * (pool.size() + 1) && 4096 * ranges.size() < points.size()) {
+            std::vector<Range> next(2 * ranges.size());
+            pool.parallelFor(0, ranges.size(), 1, [&](size_t b, size_t e) {
+                for (auto r = b; r < e; ++r) {
+                    const auto range = ranges[r];
+                    const int na = (range.a + 1) % 3;
+                    if (range.i + 1 >= range.j) {
+                        next[2 * r] = next[2 * r + 1] = {range.i, range.i, na};
+                        continue;
+                    }
+                    const Index m = (range.i + range.j) / 2;
+                    std::nth_element(_indices.begin() + range.i, _indices.begin() + m, _indices.begin() + range.j,
+                                     [&](Index ip, Index jp) { return _points[ip][range.a] < _points[jp][range.a]; });
+                    next[2 * r] = {range.i, m, na};
+                    next[2 * r + 1] = {m + 1, range.j, na};
+                }
+            });
+            ranges.swap(next);
+        }
+        pool.parallelFor(0, ranges.size(), 1, [&](size_t b, size_t e) {
+            for (auto r = b; r < e; ++r) buildKDTree(ranges[r].i, ranges[r].j, ranges[r].a);
+        });
     }
+};
+
+/// Computes the mean curvature vector of the varifold made of the given
+/// positions at each of its points, \a project(j, v) being the
+/// projection of v onto the tangent plane of the point j. Sequential
+/// reference the engines are checked against (see checkVarifoldKernels).
+template <typename Projector>
+std::vector<RealVector> computeVarifoldCurvatures(const SH3::RealPoints& positions, const Projector& project, const double cRadius, const DistributionType cDistribType, const double kernelA = 10.0) {
+    std::vector<RealVector> curvatures;
+    curvatures.reserve(positions.size());
+    RadialDistance rd(RealPoint(), cRadius, cDistribType, kernelA);
+    const ArenaScope scope;
+    ArenaVector<std::pair<double, double>> weights(ArenaAllocator<std::pair<double, double>>(scope.arena));
+    ArenaVector<size_t> indices(ArenaAllocator<size_t>(scope.arena));
+    RealVector tmpSumTop;
+    double tmpSumBottom;
+    RealVector tmpVector;
 
     auto kdTree = LinearKDTree<RealPoint, 3>(positions);
-    std::vector<size_t> indices;
-    for (auto f = 0; f < nbElements; ++f) {
+    for (auto f = 0; f < positions.size(); ++f) {
         tmpSumTop = RealVector();
         tmpSumBottom = 0;
         const auto b = kdTree.position(f);
-        rd = RadialDistance(b, cRadius, cDistribType);
-        indices = kdTree.pointsInBall(b, cRadius);
-        weights = rd(positions, indices);
+        rd.center = b;
+        kdTree.pointsInBall(b, cRadius, indices);
+        rd(positions, indices, weights);
         for (auto otherF = 0; otherF < weights.size(); ++otherF) {
             if (weights[otherF].first > 0) {
                 if (f != indices[otherF]) {
                     tmpVector = positions[indices[otherF]] - b;
-                    tmpSumTop += weights[otherF].second * projection(tmpVector, normals[indices[otherF]])/tmpVector.norm();
+                    tmpSumTop += weights[otherF].second * project(indices[otherF], tmpVector)/tmpVector.norm();
                 }
                 tmpSumBottom += weights[otherF].first;
             }
@@ -205,49 +794,802 @@ std::vector<RealVector> computeLocalCurvature(const CountedPtr<SH3::BinaryImage>
     return curvatures;
 }
 
-std::vector<Varifold> computeVarifolds(const CountedPtr<SH3::BinaryImage>& bimage, const CountedPtr<SH3::DigitalSurface>& surface, const double cRadius, const DistributionType cDistribType, const Method method, const double gridStep = 1.0) {
-    std::vector<Varifold> varifolds;
+/// Computes the mean curvature vector of the varifold made of the given
+/// positions and tangent planes (given by their normals) at each of its
+/// points.
+std::vector<RealVector> computeVarifoldCurvatures(const SH3::RealPoints& positions, const SH3::RealVectors& normals, const double cRadius, const DistributionType cDistribType, const double kernelA = 10.0) {
+    return computeVarifoldCurvatures(positions, [&normals](const size_t j, const RealVector& v) {
+        return projection(v, normals[j]);
+    }, cRadius, cDistribType, kernelA);
+}
 
-    auto ps = *SH3::makePrimalSurfaceMesh(surface);
+/**
+ * @brief Structure-of-arrays storage of the positions and projection
+ * data of the elements fed to the batched kernels. Normals are
+ * preprocessed once here: for Projection::Projector, each normal is
+ * normalized and the symmetric tangent projector I - nn^T is stored as 6
+ * components, so that the inner loop has neither division nor redundant
+ * dot product. For the octahedral projections, normals are stored as 4
+ * or 6 byte codes decoded in the inner loop, which cuts the bandwidth of
+ * the neighbor gathers.
+ */
+struct ElementArrays {
+    ElementArrays(const SH3::RealPoints& positions, const SH3::RealVectors& projectionData,
+                  const VarifoldBatch::Projection projection, ThreadPool& pool = sharedThreadPool())
+            : projection(projection) {
+        using VarifoldBatch::Projection;
+        const auto nbElements = positions.size();
+        x.resize(nbElements);
+        y.resize(nbElements);
+        z.resize(nbElements);
+        const auto nbQ = projection == Projection::Projector ? 6 : projection == Projection::Normal ? 3 : 0;
+        for (auto k = 0; k < nbQ; ++k) q[k].resize(nbElements);
+        if (projection == Projection::Octahedral32) oct32.resize(nbElements);
+        if (projection == Projection::Octahedral48) oct48.resize(6 * nbElements);
+        std::mutex mutex;
+        pool.parallelFor(0, nbElements, 4096, [&](size_t i, size_t j) {
+            double chunkError = 0.;
+            for (auto e = i; e < j; ++e) {
+                x[e] = positions[e][0];
+                y[e] = positions[e][1];
+                z[e] = positions[e][2];
+                const auto& d = projectionData[e];
+                if (projection == Projection::Octahedral32 || projection == Projection::Octahedral48) {
+                    const auto n = d / d.norm();
+                    double dn[3];
+                    if (projection == Projection::Octahedral32) {
+                        oct32[e] = OctahedralNormals::encode32(n[0], n[1], n[2]);
+                        OctahedralNormals::decode32(oct32[e], dn[0], dn[1], dn[2]);
+                    } else {
+                        OctahedralNormals::encode48(n[0], n[1], n[2], &oct48[6 * e]);
+                        OctahedralNormals::decode48(&oct48[6 * e], dn[0], dn[1], dn[2]);
+                    }
+                    chunkError = std::max(chunkError, std::acos(std::min(1., n.dot(RealVector(dn[0], dn[1], dn[2])))));
+                } else if (projection == Projection::Projector) {
+                    const auto n = d / d.norm();
+                    q[0][e] = 1 - n[0] * n[0];
+                    q[1][e] = -n[0] * n[1];
+                    q[2][e] = -n[0] * n[2];
+                    q[3][e] = 1 - n[1] * n[1];
+                    q[4][e] = -n[1] * n[2];
+                    q[5][e] = 1 - n[2] * n[2];
+                } else {
+                    q[0][e] = d[0];
+                    q[1][e] = d[1];
+                    q[2][e] = d[2];
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            encodingError = std::max(encodingError, chunkError * 180. / M_PI);
+        });
+    }
 
-    auto curvatures = computeLocalCurvature(bimage, surface, cRadius, cDistribType, method);
+    /// Elements of trivial normal mixtures (AxisWeights), whose three
+    /// float axis weights are stored as they are.
+    ElementArrays(const SH3::RealPoints& positions, const std::vector<TrivialNormalMixture>& mixtures,
+                  const VarifoldBatch::Projection projection, ThreadPool& pool = sharedThreadPool())
+            : projection(projection) {
+        const auto nbElements = positions.size();
+        x.resize(nbElements);
+        y.resize(nbElements);
+        z.resize(nbElements);
+        for (auto& weights : p) weights.resize(nbElements);
+        pool.parallelFor(0, nbElements, 4096, [&](size_t i, size_t j) {
+            for (auto e = i; e < j; ++e) {
+                x[e] = positions[e][0];
+                y[e] = positions[e][1];
+                z[e] = positions[e][2];
+                for (auto k = 0; k < 3; ++k) p[k][e] = mixtures[e].axisWeight(k);
+            }
+        });
+    }
 
-    SH3::RealVectors normals;
+    VarifoldBatch::Elements view() const {
+        return {x.data(), y.data(), z.data(), {q[0].data(), q[1].data(), q[2].data(), q[3].data(), q[4].data(), q[5].data()},
+                {p[0].data(), p[1].data(), p[2].data()}, oct32.data(), oct48.data()};
+    }
 
-    switch (method) {
-        case TrivialNormalFaceCentroid:
-        case CorrectedNormalFaceCentroid:
-            ps.computeFaceNormalsFromPositions();
-            if (method == Method::CorrectedNormalFaceCentroid) {
-                normals = SHG3::getIINormalVectors(bimage, SH3::getSurfelRange(surface), SHG3::defaultParameters()("verbose", 0));
-            } else {
-                ps.computeVertexNormalsFromFaceNormals();
-                normals = ps.faceNormals();
+    VarifoldBatch::Projection projection;
+    // Filled in parallel: on a NUMA-aware pool, each part is first
+    // touched, hence placed, on the node that processes it.
+    FirstTouchVector<double> x, y, z;
+    std::array<FirstTouchVector<double>, 6> q;
+    std::array<FirstTouchVector<float>, 3> p;
+    FirstTouchVector<uint32_t> oct32;
+    FirstTouchVector<uint8_t> oct48;
+    double encodingError = 0.; ///< max angle (in degrees) between the normals and their decoded codes
+};
+
+/// Batched counterpart of computeVarifoldCurvatures, computing elements
+/// in parallel from their preprocessed arrays with the kernel compiled
+/// for the profile, the projection and the lane precision. Elements are
+/// visited in the order of \a kdTree, the k-d-tree of \a positions, by
+/// chunks of \a grain, so that consecutive queries of a thread gather
+/// nearby neighbors. Once \a cancellation is cancelled, the remaining
+/// chunks are skipped.
+template <typename Profile, VarifoldBatch::Projection P, typename Scalar>
+std::vector<RealVector> computeVarifoldCurvaturesBatched(const SH3::RealPoints& positions, const ParallelKDTree& kdTree,
+                                                         const ElementArrays& arrays, const double cRadius, const Profile& profile,
+                                                         ThreadPool& pool = sharedThreadPool(), const size_t grain = 256,
+                                                         const CancellationToken& cancellation = CancellationToken()) {
+    const auto elements = arrays.view();
+    std::vector<RealVector> curvatures(positions.size());
+    const auto& order = kdTree._indices;
+    pool.parallelFor(0, positions.size(), grain, [&](size_t i, size_t j) {
+        if (cancellation.cancelled()) return;
+        double top[3];
+        double bottom;
+        const ArenaScope scope;
+        ArenaVector<size_t> indices(ArenaAllocator<size_t>(scope.arena));
+        for (auto k = i; k < j; ++k) {
+            const auto f = order[k];
+            kdTree.pointsInBall(positions[f], cRadius, indices);
+            VarifoldBatch::Kernel<Profile, P, Scalar>::run(elements, f, indices.data(), indices.size(), cRadius, profile, top, bottom);
+            curvatures[f] = -RealVector(top[0], top[1], top[2])/(bottom*cRadius);
+        }
+    });
+    return curvatures;
+}
+
+/**
+ * @brief Half neighborhoods of the elements in compressed sparse rows: the
+ * row of an element lists its neighbors closer than the radius that come
+ * after it, with their distances, so that every such pair is listed, and
+ * its distance computed, once.
+ *
+ * Elements are sorted by cubic cells of side R, indexed by a flat grid
+ * when it is not much larger than the number of elements, else by a hash
+ * table of the occupied cells. "After" means later in the same cell, or
+ * in one of the 13 forward neighbor cells (the neighbors whose offset
+ * (dz,dy,dx) is lexicographically positive).
+ */
+template <typename Scalar>
+struct HalfNeighborhoods {
+    HalfNeighborhoods(const SH3::RealPoints& positions, const double radius, const size_t grain, ThreadPool& pool,
+                      const CancellationToken& cancellation) {
+        const auto nbElements = positions.size();
+        if (nbElements > std::numeric_limits<uint32_t>::max()) throw std::runtime_error("too many elements for half neighborhoods");
+        cellStarts.assign(1, 0);
+        if (nbElements == 0) return;
+        RealPoint lower = positions[0], upper = positions[0];
+        for (const auto& p : positions) {
+            for (auto k = 0; k < 3; ++k) {
+                lower[k] = std::min(lower[k], p[k]);
+                upper[k] = std::max(upper[k], p[k]);
+            }
+        }
+        for (auto k = 0; k < 3; ++k) dims[k] = static_cast<size_t>((upper[k] - lower[k]) / radius) + 1;
+        flat = static_cast<double>(dims[0]) * dims[1] * dims[2] <= 4. * nbElements + 1024;
+        std::vector<uint64_t> keys(nbElements);
+        pool.parallelFor(0, nbElements, 4096, [&](size_t begin, size_t end) {
+            for (auto i = begin; i < end; ++i) {
+                size_t c[3];
+                for (auto k = 0; k < 3; ++k) c[k] = std::min(dims[k] - 1, static_cast<size_t>((positions[i][k] - lower[k]) / radius));
+                keys[i] = keyOf(c[0], c[1], c[2]);
             }
+        });
+        sortByCell(keys);
 
-            for (auto f = 0; f < ps.nbFaces(); ++f) {
-                varifolds.emplace_back(ps.faceCentroid(f), normals[f], curvatures[f]);
+        // Rows are built by chunks of cells of about grain elements,
+        // then concatenated.
+        const size_t nbCells = cellKeys.size();
+        const size_t cellsPerChunk = std::max<size_t>(1, grain * nbCells / nbElements);
+        const size_t nbChunks = (nbCells + cellsPerChunk - 1) / cellsPerChunk;
+        std::vector<std::vector<size_t>> chunkRowSizes(nbChunks);
+        std::vector<std::vector<uint32_t>> chunkNeighbors(nbChunks);
+        std::vector<std::vector<Scalar>> chunkDistances(nbChunks);
+        pool.parallelFor(0, nbCells, cellsPerChunk, [&](size_t begin, size_t end) {
+            if (cancellation.cancelled()) return;
+            const auto chunk = begin / cellsPerChunk;
+            auto& rowSizes = chunkRowSizes[chunk];
+            auto& rowNeighbors = chunkNeighbors[chunk];
+            auto& rowDistances = chunkDistances[chunk];
+            std::array<size_t, 13> forward;
+            for (auto c = begin; c < end; ++c) {
+                const auto nbForward = forwardCells(c, forward);
+                for (auto r = cellStarts[c]; r < cellStarts[c + 1]; ++r) {
+                    const auto i = order[r];
+                    const auto size = rowNeighbors.size();
+                    const auto add = [&](const size_t first, const size_t last) {
+                        for (auto s = first; s < last; ++s) {
+                            const auto j = order[s];
+                            const auto d = (positions[j] - positions[i]).norm();
+                            if (d >= radius) continue;
+                            rowNeighbors.push_back(static_cast<uint32_t>(j));
+                            rowDistances.push_back(static_cast<Scalar>(d));
+                        }
+                    };
+                    add(r + 1, cellStarts[c + 1]);
+                    for (size_t f = 0; f < nbForward; ++f) add(cellStarts[forward[f]], cellStarts[forward[f] + 1]);
+                    rowSizes.push_back(rowNeighbors.size() - size);
+                }
             }
-            break;
-        case DualNormalVertexPosition:
-            ps.computeFaceNormalsFromPositions();
-            ps.computeVertexNormalsFromFaceNormals();
-            for (auto v = 0; v < ps.nbVertices(); ++v) {
-                varifolds.emplace_back(ps.position(v), ps.vertexNormal(v), curvatures[v]);
+        });
+        cancellation.check();
+        rowStarts.assign(nbElements + 1, 0);
+        std::vector<size_t> chunkStarts(nbChunks + 1, 0);
+        for (size_t chunk = 0, r = 0; chunk < nbChunks; ++chunk) {
+            for (const auto size : chunkRowSizes[chunk]) {
+                rowStarts[r + 1] = rowStarts[r] + size;
+                ++r;
             }
-            break;
-        default:
-            break;
+            chunkStarts[chunk + 1] = chunkStarts[chunk] + chunkNeighbors[chunk].size();
+        }
+        neighbors.resize(chunkStarts.back());
+        distances.resize(chunkStarts.back());
+        pool.parallelFor(0, nbChunks, 1, [&](size_t begin, size_t end) {
+            for (auto chunk = begin; chunk < end; ++chunk) {
+                std::copy(chunkNeighbors[chunk].begin(), chunkNeighbors[chunk].end(), neighbors.begin() + chunkStarts[chunk]);
+                std::copy(chunkDistances[chunk].begin(), chunkDistances[chunk].end(), distances.begin() + chunkStarts[chunk]);
+                std::vector<uint32_t>().swap(chunkNeighbors[chunk]);
+                std::vector<Scalar>().swap(chunkDistances[chunk]);
+            }
+        });
+    }
+
+    /// @return the coordinates of the occupied cell \a c.
+    std::array<size_t, 3> coordinates(const size_t c) const {
+        const auto key = cellKeys[c];
+        return {{key % dims[0], key / dims[0] % dims[1], key / dims[0] / dims[1]}};
+    }
+
+    std::vector<size_t> order;      ///< elements sorted by cell
+    std::vector<uint64_t> cellKeys; ///< keys of the occupied cells, in increasing order
+    std::vector<size_t> cellStarts; ///< range of each occupied cell in order, plus the end
+    std::vector<size_t> rowStarts;  ///< range in neighbors of the row of each position in order, plus the end
+    std::vector<uint32_t> neighbors;
+    std::vector<Scalar> distances;
+
+private:
+    uint64_t keyOf(const size_t x, const size_t y, const size_t z) const {
+        return (static_cast<uint64_t>(z) * dims[1] + y) * dims[0] + x;
+    }
+
+    /// Sorts the elements by the keys of their cells: by counting sort
+    /// on the flat grid, else by comparison.
+    void sortByCell(const std::vector<uint64_t>& keys) {
+        const auto nbElements = keys.size();
+        order.resize(nbElements);
+        cellStarts.clear();
+        if (flat) {
+            std::vector<size_t> offsets(dims[0] * dims[1] * dims[2] + 1, 0);
+            for (const auto key : keys) ++offsets[key + 1];
+            std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+            cellOfKey.assign(offsets.size() - 1, noCell());
+            for (size_t key = 0; key + 1 < offsets.size(); ++key) {
+                if (offsets[key] == offsets[key + 1]) continue;
+                cellOfKey[key] = cellKeys.size();
+                cellKeys.push_back(key);
+                cellStarts.push_back(offsets[key]);
+            }
+            for (size_t i = 0; i < nbElements; ++i) order[offsets[keys[i]]++] = i;
+        } else {
+            std::iota(order.begin(), order.end(), 0);
+            std::sort(order.begin(), order.end(), [&](size_t i, size_t j) {
+                return keys[i] < keys[j] || (keys[i] == keys[j] && i < j);
+            });
+            for (size_t r = 0; r < nbElements; ++r) {
+                if (r > 0 && keys[order[r]] == keys[order[r - 1]]) continue;
+                cellByKey[keys[order[r]]] = cellKeys.size();
+                cellKeys.push_back(keys[order[r]]);
+                cellStarts.push_back(r);
+            }
+        }
+        cellStarts.push_back(nbElements);
+    }
+
+    /// Lists in \a forward the occupied forward neighbor cells of the
+    /// occupied cell \a c. @return their number.
+    size_t forwardCells(const size_t c, std::array<size_t, 13>& forward) const {
+        const auto xyz = coordinates(c);
+        size_t nb = 0;
+        for (int dz = 0; dz <= 1; ++dz) {
+            for (int dy = dz == 0 ? 0 : -1; dy <= 1; ++dy) {
+                for (int dx = dz == 0 && dy == 0 ? 1 : -1; dx <= 1; ++dx) {
+                    const long x = static_cast<long>(xyz[0]) + dx, y = static_cast<long>(xyz[1]) + dy,
+                               z = static_cast<long>(xyz[2]) + dz;
+                    if (x < 0 || y < 0 || x >= static_cast<long>(dims[0]) || y >= static_cast<long>(dims[1])
+                        || z >= static_cast<long>(dims[2])) continue;
+                    const auto cell = cellOf(keyOf(x, y, z));
+                    if (cell != noCell()) forward[nb++] = cell;
+                }
+            }
+        }
+        return nb;
+    }
+
+    /// @return the occupied cell of \a key, or noCell().
+    size_t cellOf(const uint64_t key) const {
+        if (flat) return cellOfKey[key];
+        const auto it = cellByKey.find(key);
+        return it == cellByKey.end() ? noCell() : it->second;
+    }
+
+    static size_t noCell() { return std::numeric_limits<size_t>::max(); }
+
+    size_t dims[3] = {0, 0, 0};
+    bool flat = true;
+    std::vector<size_t> cellOfKey;                   ///< flat grid
+    std::unordered_map<uint64_t, size_t> cellByKey;  ///< hashed grid
+};
+
+/**
+ * Half-pair counterpart of computeVarifoldCurvaturesBatched: each pair of
+ * elements closer than the radius is listed once in the half
+ * neighborhoods, and its distance and kernel values are computed once
+ * for both endpoints, with the kernel compiled for the profile, the
+ * projection and the lane precision.
+ *
+ * Writes are made conflict-free by coloring: the rows of a cell only
+ * write to the cell and its forward neighbors, and cells are processed by
+ * 27 colors (cell coordinates modulo 3), cells of one color, by chunks of
+ * about \a grain elements, running in parallel. Once \a cancellation is
+ * cancelled, the remaining chunks are skipped.
+ */
+template <typename Profile, VarifoldBatch::Projection P, typename Scalar>
+std::vector<RealVector> computeVarifoldCurvaturesSymmetric(const SH3::RealPoints& positions, const ElementArrays& arrays,
+                                                           const double cRadius, const Profile& profile,
+                                                           ThreadPool& pool = sharedThreadPool(), const size_t grain = 256,
+                                                           const CancellationToken& cancellation = CancellationToken()) {
+    const auto nbElements = positions.size();
+    const HalfNeighborhoods<Scalar> half(positions, cRadius, grain, pool, cancellation);
+    double selfWeight, selfDerivative;
+    profile(0., selfWeight, selfDerivative);
+    std::vector<double> top(3 * nbElements, 0.), bottom(nbElements, selfWeight);
+    const auto elements = arrays.view();
+
+    const size_t nbCells = half.cellKeys.size();
+    std::array<std::vector<size_t>, 27> cellsByColor;
+    for (size_t c = 0; c < nbCells; ++c) {
+        const auto xyz = half.coordinates(c);
+        cellsByColor[(xyz[2] % 3) * 9 + (xyz[1] % 3) * 3 + xyz[0] % 3].push_back(c);
     }
-    std::transform(varifolds.begin(), varifolds.end(), varifolds.begin(), [&gridStep](const Varifold& v) {
-        return Varifold(v.position, v.planeNormal, 0.5*v.curvature / gridStep);
+    const size_t cellsPerChunk = nbCells > 0 ? std::max<size_t>(1, grain * nbCells / nbElements) : 1;
+    for (const auto& colored : cellsByColor) {
+        pool.parallelFor(0, colored.size(), cellsPerChunk, [&](size_t begin, size_t end) {
+            if (cancellation.cancelled()) return;
+            for (auto k = begin; k < end; ++k) {
+                const auto c = colored[k];
+                for (auto r = half.cellStarts[c]; r < half.cellStarts[c + 1]; ++r) {
+                    const auto first = half.rowStarts[r];
+                    VarifoldBatch::Kernel<Profile, P, Scalar>::runPairs(elements, half.order[r], half.neighbors.data() + first,
+                                                                        half.distances.data() + first, half.rowStarts[r + 1] - first,
+                                                                        cRadius, profile, top.data(), bottom.data());
+                }
+            }
+        });
+    }
+    cancellation.check();
+    std::vector<RealVector> curvatures(nbElements);
+    pool.parallelFor(0, nbElements, 4096, [&](size_t begin, size_t end) {
+        for (auto i = begin; i < end; ++i) {
+            curvatures[i] = -RealVector(top[3 * i], top[3 * i + 1], top[3 * i + 2])/(bottom[i]*cRadius);
+        }
     });
-    return varifolds;
+    return curvatures;
+}
+
+/// Data shared by the element sources of the curvature engines: the
+/// digital surface and its primal mesh, with face and vertex normals.
+struct CurvatureEngineInput {
+    CurvatureEngineInput(const CountedPtr<SH3::BinaryImage>& bimage, const CountedPtr<SH3::DigitalSurface>& surface)
+            : bimage(bimage), surface(surface), mesh(*SH3::makePrimalSurfaceMesh(surface)) {
+        mesh.computeFaceNormalsFromPositions();
+        mesh.computeVertexNormalsFromFaceNormals();
+    }
+
+    /// Input without digital surface, e.g. the mesh of a \ref
+    /// RunLengthVolume: methods needing corrected normals are unavailable.
+    explicit CurvatureEngineInput(SH3::SurfaceMesh&& surfaceMesh) : mesh(std::move(surfaceMesh)) {
+        mesh.computeFaceNormalsFromPositions();
+        mesh.computeVertexNormalsFromFaceNormals();
+    }
+
+    CountedPtr<SH3::BinaryImage> bimage;
+    CountedPtr<SH3::DigitalSurface> surface;
+    SH3::SurfaceMesh mesh;
+
+    /// k-d-tree of the element positions, built on first use (see
+    /// cachedKDTree) and shared by all the computations on this input,
+    /// whatever their radius.
+    struct KDTreeSlot {
+        std::once_flag built;
+        std::unique_ptr<const ParallelKDTree> tree;
+    };
+    mutable std::array<KDTreeSlot, 4> kdTrees; ///< on faces, on vertices, and both in the order of their tree
+};
+
+/**
+ * Element sources of the built-in methods. A position source gives the
+ * points the curvature is computed at (Input) and the points it is
+ * reported at (Output), together with the mapping of the former to the
+ * latter (finish). A normal source gives, on faces (OnFaces) or vertices
+ * (OnVertices), the projection data of the elements, the normals
+ * reported with the varifolds and, through selectProjection, the
+ * compile-time projection the batched loop runs with.
+ */
+struct OnFaces {};
+struct OnVertices {};
+
+SH3::RealPoints meshPositions(const SH3::SurfaceMesh& mesh, OnFaces) {
+    SH3::RealPoints positions(mesh.nbFaces());
+    for (auto f = 0; f < mesh.nbFaces(); ++f) positions[f] = mesh.faceCentroid(f);
+    return positions;
+}
+
+SH3::RealPoints meshPositions(const SH3::SurfaceMesh& mesh, OnVertices) {
+    return mesh.positions();
+}
+
+/// @return the positions of \a input on faces or vertices, permuted in
+/// \a order when it is not empty.
+template <typename Place>
+SH3::RealPoints elementPositions(const CurvatureEngineInput& input, Place place, const std::vector<size_t>& order, ThreadPool& pool) {
+    auto positions = meshPositions(input.mesh, place);
+    if (order.empty()) return positions;
+    SH3::RealPoints sorted(positions.size());
+    pool.parallelFor(0, order.size(), 4096, [&](size_t i, size_t j) {
+        for (auto k = i; k < j; ++k) sorted[k] = positions[order[k]];
+    });
+    return sorted;
+}
+
+/// @return the k-d-tree of the positions of \a input on faces or
+/// vertices, or, when \a sorted, of these positions permuted in the order
+/// of that first tree. Trees are built once per input.
+template <typename Place>
+const ParallelKDTree& cachedKDTree(const CurvatureEngineInput& input, Place place, const bool sorted, ThreadPool& pool) {
+    auto& slot = input.kdTrees[2 * sorted + (std::is_same<Place, OnVertices>::value ? 1 : 0)];
+    std::call_once(slot.built, [&] {
+        const auto order = sorted ? cachedKDTree(input, place, false, pool)._indices : std::vector<size_t>();
+        slot.tree.reset(new ParallelKDTree(elementPositions(input, place, order, pool), pool));
+    });
+    return *slot.tree;
+}
+
+struct FaceCentroids {
+    typedef OnFaces Input;
+    typedef OnFaces Output;
+    static std::vector<RealVector> finish(const CurvatureEngineInput&, std::vector<RealVector>&& curvatures, ThreadPool&) {
+        return std::move(curvatures);
+    }
+};
+
+struct VertexPositions {
+    typedef OnVertices Input;
+    typedef OnVertices Output;
+    static std::vector<RealVector> finish(const CurvatureEngineInput&, std::vector<RealVector>&& curvatures, ThreadPool&) {
+        return std::move(curvatures);
+    }
+};
+
+/// Curvatures are computed on the (fewer) vertices, then averaged on the faces.
+struct InterpolatedVertices {
+    typedef OnVertices Input;
+    typedef OnFaces Output;
+    static std::vector<RealVector> finish(const CurvatureEngineInput& input, std::vector<RealVector>&& curvatures, ThreadPool& pool) {
+        return FaceVertexAverager(input.mesh).apply(curvatures, pool);
+    }
+};
+
+/// Normal vectors, preprocessed into projectors or octahedral codes.
+struct NormalVectorSource {
+    typedef SH3::RealVectors Data;
+
+    template <typename F>
+    static void selectProjection(const NormalEncoding encoding, const F& f) {
+        using VarifoldBatch::Projection;
+        switch (encoding) {
+            case NormalEncoding::FullPrecisionNormals:
+                return f(std::integral_constant<Projection, Projection::Projector>());
+            case NormalEncoding::Octahedral32Normals:
+                return f(std::integral_constant<Projection, Projection::Octahedral32>());
+            case NormalEncoding::Octahedral48Normals:
+                return f(std::integral_constant<Projection, Projection::Octahedral48>());
+        }
+    }
+};
+
+struct TrivialNormals : NormalVectorSource {
+    static void sample(const CurvatureEngineInput& input, OnFaces, SH3::RealVectors& data, SH3::RealVectors& normals) {
+        data = normals = input.mesh.faceNormals();
+    }
+    static void sample(const CurvatureEngineInput& input, OnVertices, SH3::RealVectors& data, SH3::RealVectors& normals) {
+        data = normals = input.mesh.vertexNormals();
+    }
+};
+
+struct CorrectedNormals : NormalVectorSource {
+    static void sample(const CurvatureEngineInput& input, OnFaces, SH3::RealVectors& data, SH3::RealVectors& normals) {
+        if (input.surface == nullptr) throw std::runtime_error("corrected normals need a digital surface");
+        data = normals = SHG3::getIINormalVectors(input.bimage, SH3::getSurfelRange(input.surface), SHG3::defaultParameters()("verbose", 0));
+    }
+};
+
+/// Trivial normal mixtures: axis-aligned projectors, no preprocessing.
+struct TrivialMixtureNormals {
+    typedef std::vector<TrivialNormalMixture> Data;
+
+    template <typename F>
+    static void selectProjection(const NormalEncoding, const F& f) {
+        f(std::integral_constant<VarifoldBatch::Projection, VarifoldBatch::Projection::AxisWeights>());
+    }
+    static void sample(const CurvatureEngineInput& input, OnFaces, Data& data, SH3::RealVectors& normals) {
+        data = computeTrivialNormalMixtures(input.mesh);
+        normals.resize(data.size());
+        for (auto f = 0; f < data.size(); ++f) normals[f] = data[f].meanNormal();
+    }
+};
+
+/**
+ * @brief Curvature engine of a method (position and normal sources), a
+ * kernel profile and a lane precision. Every combination of the built-in
+ * methods is instantiated and picked once by \ref selectCurvatureEngine,
+ * so that the per-element loop has no runtime branch on the method, the
+ * kernel or the projection.
+ */
+template <typename PositionSource, typename NormalSource, typename Kernel, typename Scalar>
+struct CurvatureEngine {
+    typedef typename PositionSource::Input Input;
+    typedef typename PositionSource::Output Output;
+    typedef typename NormalSource::Data Data;
+
+    static std::vector<RealVector> curvatures(const CurvatureEngineInput& input, const double cRadius,
+                                              const VarifoldOptions& options, ThreadPool& pool) {
+        Data data;
+        SH3::RealVectors normals;
+        NormalSource::sample(input, Input(), data, normals);
+        return curvaturesAt(input, data, cRadius, options, pool);
+    }
+
+    static std::vector<Varifold> varifolds(const CurvatureEngineInput& input, const double cRadius, const double gridStep,
+                                           const VarifoldOptions& options, ThreadPool& pool) {
+        Data data;
+        SH3::RealVectors normals;
+        NormalSource::sample(input, Input(), data, normals);
+        const auto curvatures = curvaturesAt(input, data, cRadius, options, pool);
+        if (!std::is_same<Input, Output>::value) NormalSource::sample(input, Output(), data, normals);
+        const auto positions = meshPositions(input.mesh, Output());
+        std::vector<Varifold> varifolds;
+        varifolds.reserve(positions.size());
+        for (auto i = 0; i < positions.size(); ++i) {
+            varifolds.emplace_back(positions[i], normals[i], 0.5*curvatures[i] / gridStep);
+        }
+        return varifolds;
+    }
+
+private:
+    static std::vector<RealVector> curvaturesAt(const CurvatureEngineInput& input, const Data& data,
+                                                const double cRadius, const VarifoldOptions& options, ThreadPool& pool) {
+        std::vector<RealVector> curvatures;
+        if (pool.nbNodes() > 1) {
+            // Elements are stored in k-d-tree order, so that the part each
+            // node processes is a spatial block, whose neighbors mostly
+            // lie in the same block, hence in local memory.
+            const auto& order = cachedKDTree(input, Input(), false, pool)._indices;
+            const auto& kdTree = cachedKDTree(input, Input(), true, pool);
+            const auto sorted = curvaturesOf(kdTree._points, permuted(data, order, pool), kdTree, cRadius, options, pool);
+            options.cancellation.check();
+            curvatures.resize(sorted.size());
+            pool.parallelFor(0, order.size(), 4096, [&](size_t i, size_t j) {
+                for (auto k = i; k < j; ++k) curvatures[order[k]] = sorted[k];
+            });
+        } else {
+            const auto& kdTree = cachedKDTree(input, Input(), false, pool);
+            curvatures = curvaturesOf(kdTree._points, data, kdTree, cRadius, options, pool);
+            options.cancellation.check();
+        }
+        return PositionSource::finish(input, std::move(curvatures), pool);
+    }
+
+    template <typename T>
+    static std::vector<T> permuted(const std::vector<T>& values, const std::vector<size_t>& order, ThreadPool& pool) {
+        std::vector<T> result(values.size());
+        pool.parallelFor(0, order.size(), 4096, [&](size_t i, size_t j) {
+            for (auto k = i; k < j; ++k) result[k] = values[order[k]];
+        });
+        return result;
+    }
+
+    static std::vector<RealVector> curvaturesOf(const SH3::RealPoints& positions, const Data& data,
+                                                const ParallelKDTree& kdTree, const double cRadius, const VarifoldOptions& options, ThreadPool& pool) {
+        using VarifoldBatch::Projection;
+        const auto profile = Kernel::make(options.kernelA);
+        const auto before = arenaStatistics();
+        std::vector<RealVector> curvatures;
+        NormalSource::selectProjection(options.normalEncoding, [&](auto projection) {
+            constexpr Projection P = decltype(projection)::value;
+            const ElementArrays arrays(positions, data, P, pool);
+            if (P == Projection::Octahedral32 || P == Projection::Octahedral48) {
+                DGtal::trace.info() << (P == Projection::Octahedral32 ? "32" : "48")
+                                    << "-bit octahedral normals: max angular error " << arrays.encodingError << " deg" << std::endl;
+            }
+            if (options.symmetricPairs) {
+                curvatures = computeVarifoldCurvaturesSymmetric<Kernel, P, Scalar>(positions, arrays, cRadius, profile, pool,
+                                                                                   options.grain, options.cancellation);
+            } else {
+                curvatures = computeVarifoldCurvaturesBatched<Kernel, P, Scalar>(positions, kdTree, arrays, cRadius, profile, pool,
+                                                                                  options.grain, options.cancellation);
+            }
+        });
+        const auto after = arenaStatistics();
+        DGtal::trace.info() << "Scratch memory: " << after.allocations - before.allocations << " arena allocations, "
+                            << after.heapBlocks - before.heapBlocks << " new heap blocks" << std::endl;
+        return curvatures;
+    }
+};
+
+/// Entry points of a curvature engine.
+struct CurvatureEngineEntry {
+    std::vector<RealVector> (*curvatures)(const CurvatureEngineInput&, double, const VarifoldOptions&, ThreadPool&);
+    std::vector<Varifold> (*varifolds)(const CurvatureEngineInput&, double, double, const VarifoldOptions&, ThreadPool&);
+};
+
+template <typename PositionSource, typename NormalSource, typename Kernel, typename Scalar>
+CurvatureEngineEntry curvatureEngineEntry() {
+    typedef CurvatureEngine<PositionSource, NormalSource, Kernel, Scalar> Engine;
+    return {&Engine::curvatures, &Engine::varifolds};
+}
+
+/// Engines of a method, indexed by 2 * DistributionType + single precision.
+template <typename PositionSource, typename NormalSource>
+std::array<CurvatureEngineEntry, 8> curvatureEngineEntries() {
+    using namespace VarifoldBatch;
+    return {{curvatureEngineEntry<PositionSource, NormalSource, LinearProfile, double>(),
+             curvatureEngineEntry<PositionSource, NormalSource, LinearProfile, float>(),
+             curvatureEngineEntry<PositionSource, NormalSource, PolynomialProfile, double>(),
+             curvatureEngineEntry<PositionSource, NormalSource, PolynomialProfile, float>(),
+             curvatureEngineEntry<PositionSource, NormalSource, ExponentialProfile, double>(),
+             curvatureEngineEntry<PositionSource, NormalSource, ExponentialProfile, float>(),
+             curvatureEngineEntry<PositionSource, NormalSource, TabulatedProfile, double>(),
+             curvatureEngineEntry<PositionSource, NormalSource, TabulatedProfile, float>()}};
+}
+
+/// @return the engine of the method, the kernel and the precision.
+const CurvatureEngineEntry& selectCurvatureEngine(const Method method, const DistributionType cDistribType, const VarifoldOptions& options) {
+    // Rows follow the order of Method.
+    static const std::array<std::array<CurvatureEngineEntry, 8>, 5> table = {{
+        curvatureEngineEntries<FaceCentroids, TrivialNormals>(),          // TrivialNormalFaceCentroid
+        curvatureEngineEntries<VertexPositions, TrivialNormals>(),        // DualNormalVertexPosition
+        curvatureEngineEntries<FaceCentroids, CorrectedNormals>(),        // CorrectedNormalFaceCentroid
+        curvatureEngineEntries<FaceCentroids, TrivialMixtureNormals>(),   // ProbabilisticOfTrivials
+        curvatureEngineEntries<InterpolatedVertices, TrivialNormals>()    // VertexInterpolation
+    }};
+    return table[method][2 * cDistribType + (options.singlePrecision ? 1 : 0)];
+}
+std::vector<RealVector> computeLocalCurvature(const CountedPtr<SH3::BinaryImage>& bimage, const CountedPtr<SH3::DigitalSurface>& surface, const double cRadius, const DistributionType cDistribType, const Method method, const VarifoldOptions& options = VarifoldOptions()) {
+    const CurvatureEngineInput input(bimage, surface);
+    return selectCurvatureEngine(method, cDistribType, options).curvatures(input, cRadius, options, sharedThreadPool());
+}
+
+/// Varifolds of a method on an input shared by several methods, e.g. by
+/// the tasks of the viewer running the methods concurrently.
+std::vector<Varifold> computeVarifolds(const CurvatureEngineInput& input, const double cRadius, const DistributionType cDistribType, const Method method, const double gridStep = 1.0, const VarifoldOptions& options = VarifoldOptions(), ThreadPool& pool = sharedThreadPool()) {
+    return selectCurvatureEngine(method, cDistribType, options).varifolds(input, cRadius, gridStep, options, pool);
+}
+
+std::vector<Varifold> computeVarifolds(const CountedPtr<SH3::BinaryImage>& bimage, const CountedPtr<SH3::DigitalSurface>& surface, const double cRadius, const DistributionType cDistribType, const Method method, const double gridStep = 1.0, const VarifoldOptions& options = VarifoldOptions()) {
+    const CurvatureEngineInput input(bimage, surface);
+    return computeVarifolds(input, cRadius, cDistribType, method, gridStep, options);
+}
+
+/// @return max_i |b_i - a_i| / max_i |a_i|.
+double relativeDifference(const std::vector<RealVector>& a, const std::vector<RealVector>& b) {
+    double difference = 0., scale = 0.;
+    for (auto i = 0; i < a.size(); ++i) {
+        difference = std::max(difference, (b[i] - a[i]).norm());
+        scale = std::max(scale, a[i].norm());
+    }
+    return scale > 0. ? difference / scale : difference;
+}
+
+/// @return sqrt(sum_i |b_i - a_i|^2 / sum_i |a_i|^2).
+double relativeRMSDifference(const std::vector<RealVector>& a, const std::vector<RealVector>& b) {
+    double difference = 0., scale = 0.;
+    for (auto i = 0; i < a.size(); ++i) {
+        difference += (b[i] - a[i]).squaredNorm();
+        scale += a[i].squaredNorm();
+    }
+    return scale > 0. ? std::sqrt(difference / scale) : std::sqrt(difference);
+}
+
+/**
+ * Regression check of the curvature engines against the reference loop
+ * computeVarifoldCurvatures, for every kernel profile, on the face
+ * centroids and trivial normals of \a input (the trivial normal face
+ * centroid method). Each engine variant is compared to the reference
+ * within its tolerance, and timed; the table is written to std::cout.
+ *
+ * The trivial normal mixtures (probabilistic of trivials method), which
+ * have no reference loop, are checked in their symmetric and float
+ * variants against their batched one. When \a input has a digital
+ * surface, a second table gives how far the curvatures of the trivial
+ * normals and of their mixtures are from those of the corrected normals.
+ * @return true if every variant is within its tolerance.
+ */
+bool checkVarifoldKernels(const CurvatureEngineInput& input, const double cRadius, const VarifoldOptions& options, ThreadPool& pool) {
+    typedef std::chrono::steady_clock Clock;
+    const auto ms = [](const Clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    };
+    struct Variant {
+        const char* name;
+        VarifoldOptions options;
+        double tolerance;
+    };
+    VarifoldOptions batched = options;
+    batched.normalEncoding = NormalEncoding::FullPrecisionNormals;
+    batched.symmetricPairs = false;
+    batched.singlePrecision = false;
+    VarifoldOptions symmetric = batched;
+    symmetric.symmetricPairs = true;
+    VarifoldOptions single = batched;
+    single.singlePrecision = true;
+    VarifoldOptions symmetricSingle = symmetric;
+    symmetricSingle.singlePrecision = true;
+    const std::vector<Variant> variants = {
+        {"batched", batched, 1e-12}, {"symmetric", symmetric, 1e-12}, {"float", single, 1e-5},
+        {"symmetric-float", symmetricSingle, 1e-5}};
+    const std::array<std::pair<DistributionType, const char*>, 4> kernels = {{
+        {DistributionType::Linear, "l"}, {DistributionType::Polynomial, "p"},
+        {DistributionType::Exponential, "e"}, {DistributionType::TabulatedExponential, "et"}}};
+
+    const auto positions = meshPositions(input.mesh, OnFaces());
+    const auto& normals = input.mesh.faceNormals();
+    bool passed = true;
+    std::cout << "kernel variant difference tolerance time(ms) reference(ms)" << std::endl;
+    for (const auto& kernel : kernels) {
+        auto start = Clock::now();
+        const auto reference = computeVarifoldCurvatures(positions, normals, cRadius, kernel.first, options.kernelA);
+        const auto referenceTime = ms(start);
+        for (const auto& variant : variants) {
+            start = Clock::now();
+            const auto curvatures = selectCurvatureEngine(TrivialNormalFaceCentroid, kernel.first, variant.options)
+                    .curvatures(input, cRadius, variant.options, pool);
+            const auto time = ms(start);
+            const auto difference = relativeDifference(reference, curvatures);
+            passed = passed && difference <= variant.tolerance;
+            std::cout << kernel.second << " " << variant.name << " " << difference << " " << variant.tolerance << " "
+                      << time << " " << referenceTime << (difference <= variant.tolerance ? "" : " FAILED") << std::endl;
+        }
+        start = Clock::now();
+        const auto mixture = selectCurvatureEngine(ProbabilisticOfTrivials, kernel.first, batched)
+                .curvatures(input, cRadius, batched, pool);
+        const auto mixtureTime = ms(start);
+        for (const auto& variant : variants) {
+            if (variant.name == std::string("batched")) continue;
+            start = Clock::now();
+            const auto curvatures = selectCurvatureEngine(ProbabilisticOfTrivials, kernel.first, variant.options)
+                    .curvatures(input, cRadius, variant.options, pool);
+            const auto time = ms(start);
+            const auto difference = relativeDifference(mixture, curvatures);
+            passed = passed && difference <= variant.tolerance;
+            std::cout << kernel.second << " mixture-" << variant.name << " " << difference << " " << variant.tolerance << " "
+                      << time << " " << mixtureTime << (difference <= variant.tolerance ? "" : " FAILED") << std::endl;
+        }
+    }
+    if (input.surface == nullptr) return passed;
+    std::cout << "kernel normals max-difference-to-corrected rms-difference-to-corrected" << std::endl;
+    for (const auto& kernel : kernels) {
+        const auto curvaturesOf = [&](const Method method) {
+            return selectCurvatureEngine(method, kernel.first, batched).curvatures(input, cRadius, batched, pool);
+        };
+        const auto corrected = curvaturesOf(CorrectedNormalFaceCentroid);
+        const auto trivial = curvaturesOf(TrivialNormalFaceCentroid);
+        const auto mixture = curvaturesOf(ProbabilisticOfTrivials);
+        std::cout << kernel.second << " trivial " << relativeDifference(corrected, trivial) << " "
+                  << relativeRMSDifference(corrected, trivial) << std::endl;
+        std::cout << kernel.second << " mixture " << relativeDifference(corrected, mixture) << " "
+                  << relativeRMSDifference(corrected, mixture) << std::endl;
+    }
+    return passed;
 }
 
 DistributionType argToDistribType(const std::string& arg) {
     if (arg == "e") {
         return DistributionType::Exponential;
+    } else if (arg == "et") {
+        return DistributionType::TabulatedExponential;
     } else if (arg == "l") {
         return DistributionType::Linear;
     } else {
@@ -269,6 +1611,52 @@ Method argToMethod(const std::string& arg) {
     }
 }
 
+/// Reports the instruction set of the batched kernels and the
+/// interpolation error of the tabulated exponential kernel when it is used.
+void reportKernel(const DistributionType distribType, const VarifoldOptions& options) {
+    const auto kernelA = options.kernelA;
+    DGtal::trace.info() << "Varifold kernels run with instruction set: " << VarifoldBatch::instructionSet() << std::endl;
+    if (distribType != DistributionType::TabulatedExponential) return;
+    const auto& table = ExponentialKernelTable::get(kernelA);
+    DGtal::trace.info() << "Tabulated exponential kernel (a=" << kernelA << "): max error "
+                        << table.maxError() << ", max derivative error " << table.maxDerivativeError() << std::endl;
+}
+
+/// Reads the engine options from the command line (`--a`, `--normals`,
+/// `--symmetric`, `--float`, `--grain`).
+VarifoldOptions argsToVarifoldOptions(const CommandLine& args) {
+    VarifoldOptions options;
+    options.kernelA = args.getDouble("a", options.kernelA);
+    options.symmetricPairs = args.has("symmetric");
+    options.singlePrecision = args.has("float");
+    options.grain = static_cast<size_t>(std::max(1., args.getDouble("grain", options.grain)));
+    const auto normals = args.get("normals", "full");
+    if (normals == "oct32") {
+        options.normalEncoding = NormalEncoding::Octahedral32Normals;
+    } else if (normals == "oct48") {
+        options.normalEncoding = NormalEncoding::Octahedral48Normals;
+    }
+    return options;
+}
+
+/// Creates the shared thread pool from the command line (`--threads`,
+/// `--numa`) and reports its layout.
+ThreadPool& argsToSharedThreadPool(const CommandLine& args) {
+    auto& pool = sharedThreadPool(static_cast<unsigned int>(args.getDouble("threads", 0)), args.has("numa"));
+    DGtal::trace.info() << "Thread pool: " << pool.size() << " workers";
+    if (pool.nbNodes() > 1) DGtal::trace.info() << " pinned to " << pool.nbNodes() << " NUMA nodes";
+    DGtal::trace.info() << std::endl;
+    return pool;
+}
+
+/// Reports, on a NUMA-aware pool, the fraction of the loop chunks
+/// processed on the node they were dealt to.
+void reportNumaLocality(const ThreadPool& pool) {
+    if (pool.nbNodes() <= 1) return;
+    DGtal::trace.info() << "NUMA: " << 100. * pool.localChunkFraction()
+                        << "% of the loop chunks were processed on their home node" << std::endl;
+}
+
 std::string methodToString(const Method& method) {
     switch (method) {
         case TrivialNormalFaceCentroid:
@@ -287,33 +1675,65 @@ std::string methodToString(const Method& method) {
 }
 
 
-std::vector<double> computeSignedNorms(const SH3::SurfaceMesh& primalSurface, const std::vector<Varifold>& varifolds, const Method& m)
+std::vector<double> computeSignedNorms(const SH3::SurfaceMesh& primalSurface, const std::vector<Varifold>& varifolds, const Method& m, ThreadPool& pool = sharedThreadPool(),
+                                       const CancellationToken& cancellation = CancellationToken())
 {
     std::vector<double> lcsNorm;
+    lcsNorm.reserve(varifolds.size());
     for (const auto & varifold : varifolds) {
         lcsNorm.push_back(varifold.planeNormal.dot(varifold.curvature) > 0 ? -varifold.curvature.norm() : varifold.curvature.norm());
     }
+    // The neighborhoods are gathered in parallel; the signs are then
+    // propagated sequentially and in place, as each element reads the
+    // signs already updated by the elements before it. Once \a
+    // cancellation is cancelled, the remaining elements are skipped.
+    std::vector<std::vector<size_t>> neighbors(lcsNorm.size());
     if (m == Method::DualNormalVertexPosition) {
-        for (auto i = 0; i < varifolds.size(); i++) {
-            const auto& position = primalSurface.position(i);
-            auto sum = 0.;
-            for (auto f = 0; f < varifolds.size(); f++) {
-                if (f != i && primalSurface.vertexInclusionRatio(position, 1, f) > 0) {
-                    sum += lcsNorm[f];
+        pool.parallelFor(0, varifolds.size(), 64, [&](size_t begin, size_t end) {
+            if (cancellation.cancelled()) return;
+            for (auto i = begin; i < end; i++) {
+                const auto& position = primalSurface.position(i);
+                for (auto f = 0; f < varifolds.size(); f++) {
+                    if (f != i && primalSurface.vertexInclusionRatio(position, 1, f) > 0) {
+                        neighbors[i].push_back(f);
+                    }
                 }
             }
-            lcsNorm[i] = abs(lcsNorm[i]) * (sum < 0 ? -1 : 1);
-        }
+        });
     } else {
-        for (auto i = 0; i < varifolds.size(); i++) {
-            auto sum = 0.;
-            for (auto f: primalSurface.computeFacesInclusionsInBall(1, i)) {
-                if (f.second > 0) {
-                    sum += lcsNorm[f.first];
+        pool.parallelFor(0, varifolds.size(), 1024, [&](size_t begin, size_t end) {
+            if (cancellation.cancelled()) return;
+            for (auto i = begin; i < end; i++) {
+                for (auto f: primalSurface.computeFacesInclusionsInBall(1, i)) {
+                    if (f.second > 0) {
+                        neighbors[i].push_back(f.first);
+                    }
                 }
             }
-            lcsNorm[i] = abs(lcsNorm[i]) * (sum < 0 ? -1 : 1);
+        });
+    }
+    cancellation.check();
+    for (auto i = 0; i < lcsNorm.size(); i++) {
+        auto sum = 0.;
+        for (const auto f : neighbors[i]) {
+            sum += lcsNorm[f];
         }
+        lcsNorm[i] = abs(lcsNorm[i]) * (sum < 0 ? -1 : 1);
     }
     return lcsNorm;
-}
\ No newline at end of file
+}
+
+/// Streams to \a emit the features of the signed norms of a method (see
+/// \ref extractFeatures): faces, or vertices for DualNormalVertexPosition,
+/// are connected through the edges of \a primalSurface.
+size_t extractCurvatureFeatures(const SH3::SurfaceMesh& primalSurface, const std::vector<double>& signedNorms, const Method& m,
+                                const double threshold, const std::function<void(FeatureComponent&&)>& emit,
+                                const size_t minSize = 1, ThreadPool& pool = sharedThreadPool())
+{
+    if (m == Method::DualNormalVertexPosition) {
+        return extractFeatures(signedNorms, threshold, [&](const size_t v) -> decltype(auto) { return primalSurface.neighborVertices(v); },
+                               emit, pool, minSize);
+    }
+    return extractFeatures(signedNorms, threshold, [&](const size_t f) -> decltype(auto) { return primalSurface.neighborFaces(f); },
+                           emit, pool, minSize);
+}
@@ -0,0 +1,132 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+#include "threadPool.h"
+
+/**
+ * @brief Streaming statistics of absolute errors: maximum, mean, L2
+ * norm, quantiles and histogram, computed in one pass without storing
+ * the errors.
+ *
+ * Quantiles and histograms come from a mergeable logarithmic sketch:
+ * an error e > 0 falls in bucket ceil(log_g(e)) with g = (1+a)/(1-a),
+ * so that any quantile is known up to a relative error a. The buckets
+ * are a fixed array covering [\ref lowestError, \ref highestError]:
+ * errors outside fall in the first or last bucket (the maximum stays
+ * exact). Statistics computed on separate chunks can be merged, which
+ * makes the accumulation parallel.
+ */
+class ErrorStatistics {
+public:
+    /// @param relativeAccuracy the relative accuracy \a a of quantiles.
+    explicit ErrorStatistics(const double relativeAccuracy = 0.01)
+            : gamma((1 + relativeAccuracy) / (1 - relativeAccuracy)), logGamma(std::log(gamma)),
+              firstExponent(static_cast<int>(std::ceil(std::log(lowestError()) / logGamma))),
+              buckets(static_cast<int>(std::ceil(std::log(highestError()) / logGamma)) - firstExponent + 1, 0) {
+    }
+
+    /// Bounds of the errors the buckets tell apart.
+    static double lowestError() { return 1e-12; }
+    static double highestError() { return 1e12; }
+
+    void add(const double error) {
+        const double e = std::fabs(error);
+        ++n;
+        sum += e;
+        sumSquares += e * e;
+        maxValue = std::max(maxValue, e);
+        if (e <= std::numeric_limits<double>::min()) {
+            ++nbZeros;
+        } else {
+            const auto k = static_cast<int>(std::ceil(std::log(std::min(std::max(e, lowestError()), highestError())) / logGamma));
+            ++buckets[std::min<size_t>(std::max(0, k - firstExponent), buckets.size() - 1)];
+        }
+    }
+
+    /// Merges statistics computed with the same relative accuracy.
+    void merge(const ErrorStatistics& other) {
+        n += other.n;
+        sum += other.sum;
+        sumSquares += other.sumSquares;
+        maxValue = std::max(maxValue, other.maxValue);
+        nbZeros += other.nbZeros;
+        for (size_t k = 0; k < buckets.size(); ++k) buckets[k] += other.buckets[k];
+    }
+
+    size_t count() const { return n; }
+    double max() const { return maxValue; }
+    double mean() const { return n > 0 ? sum / n : 0.; }
+
+    /// @return sqrt(sum e^2 / n), as SHG3::getScalarsNormL2.
+    double normL2() const { return n > 0 ? std::sqrt(sumSquares / n) : 0.; }
+
+    /// @return the \a q-quantile (q in [0,1]) of the errors, up to the
+    /// relative accuracy of the sketch.
+    double quantile(const double q) const {
+        if (n == 0) return 0.;
+        const auto rank = static_cast<uint64_t>(std::floor(q * (n - 1)));
+        uint64_t seen = nbZeros;
+        if (rank < seen) return 0.;
+        for (size_t k = 0; k < buckets.size(); ++k) {
+            seen += buckets[k];
+            if (rank < seen) return std::min(maxValue, representative(k));
+        }
+        return maxValue;
+    }
+
+    /// @return the number of errors in each of the \a nbBins bins of
+    /// [0, maxBinValue] (errors above are counted in the last bin). Counts
+    /// are approximate: each bucket of the sketch is counted in the bin of
+    /// its representative value, so that an error within the relative
+    /// accuracy of a bin boundary may be counted in the neighboring bin.
+    std::vector<uint64_t> histogram(const size_t nbBins, const double maxBinValue) const {
+        std::vector<uint64_t> bins(nbBins, 0);
+        if (nbBins == 0 || maxBinValue <= 0) return bins;
+        bins[0] += nbZeros;
+        for (size_t k = 0; k < buckets.size(); ++k) {
+            if (buckets[k] == 0) continue;
+            const auto i = std::min(nbBins - 1, static_cast<size_t>(representative(k) / maxBinValue * nbBins));
+            bins[i] += buckets[k];
+        }
+        return bins;
+    }
+
+    /// Accumulates |estimated[i] - expected[i]| over all indices, in
+    /// parallel on \a pool.
+    template <typename Estimated, typename Expected>
+    static ErrorStatistics compute(const Estimated& estimated, const Expected& expected, ThreadPool& pool,
+                                   const double relativeAccuracy = 0.01) {
+        ErrorStatistics stats(relativeAccuracy);
+        std::mutex mutex;
+        const size_t size = std::min(estimated.size(), expected.size());
+        pool.parallelFor(0, size, 16384, [&](size_t i, size_t j) {
+            ErrorStatistics local(relativeAccuracy);
+            for (auto k = i; k < j; ++k) local.add(estimated[k] - expected[k]);
+            std::lock_guard<std::mutex> lock(mutex);
+            stats.merge(local);
+        });
+        return stats;
+    }
+
+private:
+    /// @return the representative value of the bucket \a k, i.e. of
+    /// (g^(e-1), g^e] with e = k + firstExponent.
+    double representative(const size_t k) const {
+        return 2 * std::pow(gamma, static_cast<int>(k) + firstExponent) / (gamma + 1);
+    }
+
+    double gamma;
+    double logGamma;
+    int firstExponent; ///< exponent of the first bucket
+    uint64_t n = 0;
+    double sum = 0.;
+    double sumSquares = 0.;
+    double maxValue = 0.;
+    uint64_t nbZeros = 0;
+    std::vector<uint64_t> buckets; ///< counts by exponent, from firstExponent
+};
@@ -1,7 +1,11 @@
 
 #include <iostream>
 #include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <limits>
 #include "DGtal/base/Common.h"
+#include "DGtal/base/Clock.h"
 #include "DGtal/shapes/SurfaceMesh.h"
 #include "DGtal/geometry/meshes/CorrectedNormalCurrentComputer.h"
 #include "DGtal/helpers/Shortcuts.h"
@@ -10,6 +14,7 @@
 #include "DGtal/io/colormaps/GradientColorMap.h"
 #include "DGtal/io/colormaps/QuantifiedColorMap.h"
 #include "core.cpp"
+#include "errorStatistics.h"
 
 void usage( int argc, char* argv[] )
 {
@@ -27,12 +32,33 @@ void usage( int argc, char* argv[] )
               << "- <B> defines the digitization space size [-B,B]^3"      << std::endl
               << "- <h> is the gridstep digitization"                      << std::endl
               << "- <R> is the radius of the measuring balls"              << std::endl
-              << "- <kernel> is the kernel used to sample the surface ('l': linear, 'p': polynomial, 'e': exponential)" << std::endl
-              << "- <method> is the method used to compute the curvature ('tnfc': trivial normal face centroid, 'cnfc': corrected normal face centroid)" << std::endl
+              << "- <kernel> is the kernel used to sample the surface ('l': linear, 'p': polynomial, 'e': exponential, 'et': tabulated exponential)" << std::endl
+              << "- <method> is the method used to compute the curvature ('tnfc': trivial normal face centroid, 'cnfc': corrected normal face centroid, 'vi': vertex interpolation, 'pot': probabilistic of trivials)" << std::endl
               << std::endl
               << "It produces several OBJ files to display mean and"       << std::endl
               << "Gaussian curvature estimation results: `example-cnc-H.obj`" << std::endl
-              << "and `example-cnc-G.obj` as well as the associated MTL file." << std::endl;
+              << "and `example-cnc-G.obj` as well as the associated MTL file." << std::endl
+              << std::endl
+              << "Options:" << std::endl
+              << "- --convergence h1,h2,... runs a multigrid convergence study over the" << std::endl
+              << "  given gridsteps instead of a single evaluation (no viewer)" << std::endl
+              << "- --alpha a: in convergence mode, the radius at gridstep h is R*h^a" << std::endl
+              << "  (R being the radius at h=1), default 0.5" << std::endl
+              << "- --memory m: memory budget in MB used to run levels concurrently, default 4096" << std::endl
+              << "- --threads n: number of worker threads (default: all cores)" << std::endl
+              << "- --numa: pin workers to NUMA nodes and place data on the nodes processing it" << std::endl
+              << "- --cache dir: directory where true curvatures are cached per (P, B, h)" << std::endl
+              << "- --a a: parameter of the exponential kernels exp(-a/(1-r^2)), default 10" << std::endl
+              << "- --normals full|oct32|oct48: storage of normals in the curvature loop" << std::endl
+              << "  (full precision, or 32/48-bit octahedral codes)" << std::endl
+              << "- --symmetric: evaluate distances and kernels once per pair of neighbors" << std::endl
+              << "- --float: compute the batched kernels in single precision" << std::endl
+              << "- --grain n: elements per chunk of the parallel curvature loop, default 256" << std::endl
+              << "- --check-kernels: compare the curvature engines with the reference loop" << std::endl
+              << "  for every kernel, at gridstep h and radius R (no viewer)" << std::endl
+              << "- --features t: write the ridges and valleys (elements with |H| >= t) to" << std::endl
+              << "  `example-cnc-features.txt`, one line per connected component" << std::endl
+              << "- --feature-size n: smallest number of elements of a written feature, default 1" << std::endl;
     std::cout << "You may either write your own polynomial as 3*x^2*y-z^2*x*y+1" << std::endl
               <<"or use a predefined polynomial in the following list:" << std::endl;
     auto L = SH::getPolynomialList();
@@ -40,10 +66,299 @@ void usage( int argc, char* argv[] )
         std::cout << p.first << " : " << p.second << std::endl;
 }
 
+/// Builds the primal surface mesh of \a surface with vertices scaled by the gridstep \a h.
+SH3::SurfaceMesh makeScaledSurfaceMesh(const SH3::KSpace& K, const CountedPtr<SH3::DigitalSurface>& surface, const double h)
+{
+    SH3::SurfaceMesh smesh;
+    std::vector< SH3::SurfaceMesh::Vertices > faces;
+    SH3::Cell2Index c2i;
+    auto embedder = SH3::getCellEmbedder( K );
+    auto pointels = SH3::getPointelRange( c2i, surface );
+    auto vertices = SH3::RealPoints( pointels.size() );
+    std::transform( pointels.cbegin(), pointels.cend(), vertices.begin(),
+                    [&] (const SH3::Cell& c) { return h * embedder( c ); } );
+    for ( auto&& surfel : *surface )
+    {
+        const auto primal_surfel_vtcs = SH3::getPointelRange( K, surfel );
+        SH3::SurfaceMesh::Vertices face;
+        for ( auto&& primal_vtx : primal_surfel_vtcs )
+            face.push_back( c2i[ primal_vtx ] );
+        faces.push_back( face );
+    }
+    smesh.init( vertices.cbegin(), vertices.cend(),
+                faces.cbegin(),    faces.cend() );
+    return smesh;
+}
+
+/**
+ * @brief Evaluator of the true curvatures of the implicit shape at the
+ * surfels. Surfels are projected onto the shape in parallel, by chunks,
+ * and results are cached per (polynomial, B, h, projection and traversal
+ * parameters), in memory and, when a cache directory is given, on disk so
+ * that radius or kernel sweeps can reuse them across runs. Cache files
+ * hold their full key, checked on load.
+ */
+class GroundTruth
+{
+public:
+    enum Curvature { Mean, Gaussian };
+
+    GroundTruth( const SH3::ImplicitShape3D& parsedShape, std::string polynomial, const double B,
+                 ThreadPool& pool, std::string cacheDirectory = "", IOQueue& io = sharedIOQueue() )
+        : parsedShape( parsedShape ), polynomial( std::move( polynomial ) ), B( B ),
+          pool( pool ), cacheDirectory( std::move( cacheDirectory ) ), io( io ) {}
+
+    const SH3::ImplicitShape3D& shape() const { return parsedShape; }
+
+    SH3::Scalars get( const Curvature curvature, const SH3::KSpace& K, const SH3::SurfelRange& surfels,
+                      const Parameters& params, const double h )
+    {
+        const auto key = makeKey( curvature, params, h );
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            const auto it = cache.find( key );
+            if ( it != cache.end() && it->second.size() == surfels.size() ) return it->second;
+        }
+        SH3::Scalars values;
+        if ( !load( key, surfels.size(), values ) )
+        {
+            values = compute( curvature, K, surfels, params );
+            save( key, values );
+        }
+        std::lock_guard<std::mutex> lock( mutex );
+        cache[ key ] = values;
+        return values;
+    }
+
+private:
+    SH3::Scalars compute( const Curvature curvature, const SH3::KSpace& K, const SH3::SurfelRange& surfels,
+                          const Parameters& params )
+    {
+        SH3::Scalars values( surfels.size() );
+        pool.parallelFor( 0, surfels.size(), 2048, [&] ( size_t i, size_t j )
+        {
+            // CountedPtr reference counts are not thread-safe: every chunk
+            // projects onto its own copy of the shape.
+            auto shape = CountedPtr<SH3::ImplicitShape3D>( new SH3::ImplicitShape3D( parsedShape ) );
+            const SH3::SurfelRange chunk( surfels.begin() + i, surfels.begin() + j );
+            const auto chunkValues = curvature == Mean
+                                     ? SHG3::getMeanCurvatures( shape, K, chunk, params )
+                                     : SHG3::getGaussianCurvatures( shape, K, chunk, params );
+            std::copy( chunkValues.begin(), chunkValues.end(), values.begin() + i );
+        } );
+        return values;
+    }
+
+    /// @return the key of the values: every parameter they depend on,
+    /// with doubles written exactly.
+    std::string makeKey( const Curvature curvature, const Parameters& params, const double h ) const
+    {
+        std::stringstream ss;
+        ss << std::setprecision( std::numeric_limits<double>::max_digits10 )
+           << polynomial << "|" << B << "|" << h << "|" << ( curvature == Mean ? "H" : "G" )
+           << "|" << params[ "projectionMaxIter" ].as_int()
+           << "|" << params[ "projectionAccuracy" ].as_double()
+           << "|" << params[ "projectionGamma" ].as_double()
+           << "|" << params[ "offset" ].as_double()
+           << "|" << params[ "surfaceTraversal" ].as_string();
+        return ss.str();
+    }
+
+    /// @return the cache file of \a key, named after its FNV-1a hash,
+    /// which unlike std::hash does not change across builds.
+    std::string cacheFile( const std::string& key ) const
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for ( const unsigned char c : key ) hash = ( hash ^ c ) * 1099511628211ull;
+        std::stringstream ss;
+        ss << cacheDirectory << "/truth-" << std::hex << hash << ".bin";
+        return ss.str();
+    }
+
+    bool load( const std::string& key, const size_t expectedSize, SH3::Scalars& values ) const
+    {
+        if ( cacheDirectory.empty() ) return false;
+        std::ifstream in( cacheFile( key ), std::ios::binary );
+        if ( !in ) return false;
+        uint64_t keySize = 0;
+        in.read( reinterpret_cast<char*>( &keySize ), sizeof( keySize ) );
+        if ( !in || keySize != key.size() ) return false;
+        std::string storedKey( keySize, '\0' );
+        in.read( &storedKey[ 0 ], keySize );
+        if ( !in || storedKey != key ) return false;
+        uint64_t size = 0;
+        in.read( reinterpret_cast<char*>( &size ), sizeof( size ) );
+        if ( !in || size != expectedSize ) return false;
+        values.resize( size );
+        in.read( reinterpret_cast<char*>( values.data() ), size * sizeof( double ) );
+        return static_cast<bool>( in );
+    }
+
+    /// Writes \a values on the I/O queue, so that the levels of a
+    /// convergence study do not wait on the disk.
+    void save( const std::string& key, const SH3::Scalars& values ) const
+    {
+        if ( cacheDirectory.empty() ) return;
+        io.submit( [ file = cacheFile( key ), key, values ]
+        {
+            std::ofstream out( file, std::ios::binary );
+            const uint64_t keySize = key.size();
+            out.write( reinterpret_cast<const char*>( &keySize ), sizeof( keySize ) );
+            out.write( key.data(), keySize );
+            const uint64_t size = values.size();
+            out.write( reinterpret_cast<const char*>( &size ), sizeof( size ) );
+            out.write( reinterpret_cast<const char*>( values.data() ), size * sizeof( double ) );
+            if ( !out ) trace.warning() << "Unable to write ground truth cache " << file << std::endl;
+        } );
+    }
+
+    const SH3::ImplicitShape3D& parsedShape;
+    const std::string polynomial;
+    const double B;
+    ThreadPool& pool;
+    const std::string cacheDirectory;
+    IOQueue& io;
+    std::mutex mutex;
+    std::map<std::string, SH3::Scalars> cache;
+};
+
+/// Results of the evaluation of the estimator at one gridstep.
+struct ConvergenceLevel
+{
+    double h;          ///< gridstep
+    double radius;     ///< radius of the measuring ball (physical units)
+    size_t nbSurfels;
+    double errorHmax;  ///< |He-H|_oo
+    double errorHl2;   ///< |He-H|_2
+    double errorHmean; ///< mean of |He-H|
+    double errorHp90;  ///< 90th percentile of |He-H|
+    double time;       ///< in ms
+};
+
+/// Rough estimate (in bytes) of the memory needed to process one level:
+/// one bit per voxel of the binary image, plus a fixed budget per surfel
+/// for the meshes, normals, varifolds and the kd-tree.
+double estimateLevelMemory( const double B, const double h )
+{
+    const double n = 2.0 * B / h;
+    return n * n * n / 8.0 + 6.0 * n * n * 1024.0;
+}
+
+/// Digitizes the shape at gridstep \a h and evaluates the mean curvature
+/// estimated with a ball of (physical) radius \a R against the true one.
+ConvergenceLevel evaluateLevel( GroundTruth& truth, ThreadPool& pool, Parameters params,
+                                const double h, const double R,
+                                const DistributionType kernel, const VarifoldOptions& options, const Method method )
+{
+    Clock clock;
+    clock.startClock();
+    params( "gridstep", h );
+    // Each level works on its own copy of the parsed shape: CountedPtr
+    // reference counts are not thread-safe, so handles must not be
+    // shared between levels running concurrently.
+    auto shape   = CountedPtr<SH3::ImplicitShape3D>( new SH3::ImplicitShape3D( truth.shape() ) );
+    auto K       = SH3::getKSpace( params );
+    auto dshape  = SH3::makeDigitizedImplicitShape3D( shape, params );
+    auto bimage  = SH3::makeBinaryImage( dshape, params );
+    auto surface = SH3::makeDigitalSurface( bimage, K, params );
+    auto surfels = SH3::getSurfelRange( surface, params );
+    auto smesh   = makeScaledSurfaceMesh( K, surface, h );
+
+    const auto varifolds = computeVarifolds( bimage, surface, R / h, kernel, method, h, options );
+    const auto H         = computeSignedNorms( smesh, varifolds, method );
+    const auto exp_H     = truth.get( GroundTruth::Mean, K, surfels, params, h );
+
+    ConvergenceLevel level;
+    level.h         = h;
+    level.radius    = R;
+    level.nbSurfels = surfels.size();
+    const auto errorH = ErrorStatistics::compute( H, exp_H, pool );
+    level.errorHmax  = errorH.max();
+    level.errorHl2   = errorH.normL2();
+    level.errorHmean = errorH.mean();
+    level.errorHp90  = errorH.quantile( 0.9 );
+    level.time      = clock.stopClock();
+    return level;
+}
+
+/// @return the slope of the least-square line fitting log(error) against log(h).
+double convergenceRate( const std::vector<ConvergenceLevel>& levels,
+                        const std::function<double(const ConvergenceLevel&)>& error )
+{
+    double mx = 0., my = 0.;
+    for ( const auto& l : levels ) { mx += log( l.h ); my += log( error( l ) ); }
+    mx /= levels.size();
+    my /= levels.size();
+    double sxy = 0., sxx = 0.;
+    for ( const auto& l : levels )
+    {
+        sxy += ( log( l.h ) - mx ) * ( log( error( l ) ) - my );
+        sxx += ( log( l.h ) - mx ) * ( log( l.h ) - mx );
+    }
+    return sxx > 0. ? sxy / sxx : 0.;
+}
+
+/// Evaluates all the gridsteps in one process, sharing the parsed shape
+/// and the thread pool. Levels run concurrently as long as their
+/// estimated memory fits in \a memoryBudget (in bytes); a level that
+/// does not fit even alone is run by itself.
+std::vector<ConvergenceLevel> runConvergenceStudy( GroundTruth& truth, const Parameters& params,
+                                                   const double B, std::vector<double> gridsteps,
+                                                   const double R, const double alpha,
+                                                   const DistributionType kernel, const VarifoldOptions& options, const Method method,
+                                                   const double memoryBudget, ThreadPool& pool )
+{
+    // Finest gridsteps first: they give the largest meshes, hence the
+    // longest computations, which should start early.
+    std::sort( gridsteps.begin(), gridsteps.end() );
+    std::mutex mutex;
+    std::condition_variable released;
+    double reserved = 0.;
+    std::vector<std::future<ConvergenceLevel>> futures;
+    for ( const auto h : gridsteps )
+    {
+        const double needed = estimateLevelMemory( B, h );
+        {
+            std::unique_lock<std::mutex> lock( mutex );
+            released.wait( lock, [&] { return reserved == 0. || reserved + needed <= memoryBudget; } );
+            reserved += needed;
+        }
+        const double Rh = R * pow( h, alpha );
+        futures.push_back( pool.submit( [&, h, Rh, needed] {
+            // Released even when the level throws, so that the levels
+            // waiting for memory still start.
+            struct Reservation
+            {
+                ~Reservation()
+                {
+                    {
+                        std::lock_guard<std::mutex> lock( mutex );
+                        reserved -= needed;
+                    }
+                    released.notify_all();
+                }
+                std::mutex& mutex;
+                double& reserved;
+                std::condition_variable& released;
+                const double needed;
+            } reservation{ mutex, reserved, released, needed };
+            return evaluateLevel( truth, pool, params, h, Rh, kernel, options, method );
+        } ) );
+    }
+    // All the levels finish before any exception is rethrown, as they
+    // refer to the locals of this function.
+    for ( auto& f : futures ) f.wait();
+    std::vector<ConvergenceLevel> levels;
+    for ( auto& f : futures ) levels.push_back( f.get() );
+    std::sort( levels.begin(), levels.end(),
+               [] ( const ConvergenceLevel& a, const ConvergenceLevel& b ) { return a.h > b.h; } );
+    return levels;
+}
+
 int main( int argc, char* argv[] )
 {
-    polyscope::init();
-    if ( argc <= 1 )
+    const CommandLine args( argc, argv );
+    if ( args.positional.size() <= 1 )
     {
         usage( argc, argv );
         return 0;
@@ -54,13 +369,16 @@ int main( int argc, char* argv[] )
     typedef CorrectedNormalCurrentComputer< RealPoint, RealVector > CNC;
     typedef Shortcuts< KSpace >          SH;
     typedef ShortcutsGeometry< KSpace > SHG;
-    std::string  poly = argv[ 1 ]; // polynomial
-    const double    B = argc > 2 ? atof( argv[ 2 ] ) : 1.0; // max ||_oo bbox
-    const double    h = argc > 3 ? atof( argv[ 3 ] ) : 1.0; // gridstep
-    const double    R = argc > 4 ? atof( argv[ 4 ] ) : 2.0; // radius of measuring ball
-    const auto kernel = argc > 5 ? argToDistribType( argv[ 5 ] ) : DistributionType::Polynomial;
-    const auto method = argc > 6 ? argToMethod( argv[ 6 ] ) : Method::CorrectedNormalFaceCentroid;
-    const auto checkCNC = argc > 7;
+    const auto& pargs = args.positional;
+    std::string  poly = pargs[ 1 ]; // polynomial
+    const double    B = pargs.size() > 2 ? atof( pargs[ 2 ].c_str() ) : 1.0; // max ||_oo bbox
+    const double    h = pargs.size() > 3 ? atof( pargs[ 3 ].c_str() ) : 1.0; // gridstep
+    const double    R = pargs.size() > 4 ? atof( pargs[ 4 ].c_str() ) : 2.0; // radius of measuring ball
+    const auto kernel = pargs.size() > 5 ? argToDistribType( pargs[ 5 ] ) : DistributionType::Polynomial;
+    const auto method = pargs.size() > 6 ? argToMethod( pargs[ 6 ] ) : Method::CorrectedNormalFaceCentroid;
+    const auto checkCNC = pargs.size() > 7;
+    const auto options = argsToVarifoldOptions( args );
+    reportKernel( kernel, options );
 
     // Read polynomial and build digital surface
     auto params = SH::defaultParameters() | SHG::defaultParameters();
@@ -69,6 +387,50 @@ int main( int argc, char* argv[] )
     params( "minAABB", -B )( "maxAABB", B );
     params( "offset", 3.0 );
     auto shape       = SH::makeImplicitShape3D( params );
+    ThreadPool& pool = argsToSharedThreadPool( args );
+    GroundTruth truth( *shape, poly, B, pool, args.get( "cache", "" ) );
+
+    if ( args.has( "convergence" ) )
+    {
+        const auto gridsteps = args.getDoubles( "convergence" );
+        if ( gridsteps.empty() )
+        {
+            trace.error() << "No gridstep given to --convergence" << std::endl;
+            return 1;
+        }
+        const double alpha  = args.getDouble( "alpha", 0.5 );
+        const double budget = args.getDouble( "memory", 4096. ) * 1024. * 1024.;
+        const auto levels = runConvergenceStudy( truth, params, B, gridsteps, R, alpha,
+                                                 kernel, options, method, budget, pool );
+        std::cout << "h R #surfels |He-H|_oo |He-H|_2 mean(|He-H|) p90(|He-H|) time(ms)" << std::endl;
+        for ( const auto& l : levels )
+            std::cout << l.h << " " << l.radius << " " << l.nbSurfels << " "
+                      << l.errorHmax << " " << l.errorHl2 << " " << l.errorHmean << " "
+                      << l.errorHp90 << " " << l.time << std::endl;
+        if ( levels.size() > 1 )
+        {
+            std::cout << "Convergence rate |He-H|_oo: h^"
+                      << convergenceRate( levels, [] ( const ConvergenceLevel& l ) { return l.errorHmax; } )
+                      << std::endl;
+            std::cout << "Convergence rate |He-H|_2 : h^"
+                      << convergenceRate( levels, [] ( const ConvergenceLevel& l ) { return l.errorHl2; } )
+                      << std::endl;
+        }
+        reportNumaLocality( pool );
+        return 0;
+    }
+
+    if ( args.has( "check-kernels" ) )
+    {
+        auto K       = SH::getKSpace( params );
+        auto dshape  = SH::makeDigitizedImplicitShape3D( shape, params );
+        auto bimage  = SH::makeBinaryImage( dshape, params );
+        auto surface = SH::makeDigitalSurface( bimage, K, params );
+        const CurvatureEngineInput input( bimage, surface );
+        return checkVarifoldKernels( input, R, options, pool ) ? 0 : 1;
+    }
+
+    polyscope::init();
     auto K           = SH::getKSpace( params );
     auto dshape      = SH::makeDigitizedImplicitShape3D( shape, params );
     auto bimage      = SH::makeBinaryImage( dshape, params );
@@ -78,38 +440,20 @@ int main( int argc, char* argv[] )
                       << poly.c_str() << ">" << std::endl;
         return 1;
     }
-    auto sembedder   = SH::getSCellEmbedder( K );
-    auto embedder    = SH::getCellEmbedder( K );
     auto surface     = SH::makeDigitalSurface( bimage, K, params );
     auto surfels     = SH::getSurfelRange( surface, params );
     trace.info() << "- surface has " << surfels.size()<< " surfels." << std::endl;
 
-    SM smesh;
-    std::vector< SM::Vertices > faces;
-    SH::Cell2Index c2i;
-    auto pointels = SH::getPointelRange( c2i, surface );
-    auto vertices = SH::RealPoints( pointels.size() );
-    std::transform( pointels.cbegin(), pointels.cend(), vertices.begin(),
-                    [&] (const SH::Cell& c) { return h * embedder( c ); } );
-    for ( auto&& surfel : *surface )
-    {
-        const auto primal_surfel_vtcs = SH::getPointelRange( K, surfel );
-        SM::Vertices face;
-        for ( auto&& primal_vtx : primal_surfel_vtcs )
-            face.push_back( c2i[ primal_vtx ] );
-        faces.push_back( face );
-    }
-    smesh.init( vertices.cbegin(), vertices.cend(),
-                faces.cbegin(),    faces.cend() );
+    SM smesh = makeScaledSurfaceMesh( K, surface, h );
     trace.info() << smesh << std::endl;
 
     auto polysurf = registerSurface(smesh, "studied mesh");
 
 
-    std::vector<Varifold> varifolds = computeVarifolds(bimage, surface, R, kernel, method, h);
+    std::vector<Varifold> varifolds = computeVarifolds(bimage, surface, R, kernel, method, h, options);
 
-    auto exp_H = SHG::getMeanCurvatures( shape, K, surfels, params );
-    auto exp_G = SHG::getGaussianCurvatures( shape, K, surfels, params );
+    auto exp_H = truth.get( GroundTruth::Mean, K, surfels, params, h );
+    auto exp_G = truth.get( GroundTruth::Gaussian, K, surfels, params, h );
 
     std::vector< double > H = computeSignedNorms(smesh, varifolds, method);
     std::vector< double > G( varifolds.size() );
@@ -131,16 +475,17 @@ int main( int argc, char* argv[] )
               << " min=" << *G_min_max.first << " max=" << *G_min_max.second
               << std::endl;
 
-    const auto      error_H = SHG::getScalarsAbsoluteDifference( H, exp_H );
-    const auto stat_error_H = SHG::getStatistic( error_H );
-    const auto   error_H_l2 = SHG::getScalarsNormL2( H, exp_H );
+    const auto stat_error_H = ErrorStatistics::compute( H, exp_H, pool );
     trace.info() << "|He-H|_oo = " << stat_error_H.max() << std::endl;
-    trace.info() << "|He-H|_2  = " << error_H_l2 << std::endl;
-    const auto      error_G = SHG::getScalarsAbsoluteDifference( G, exp_G );
-    const auto stat_error_G = SHG::getStatistic( error_G );
-    const auto   error_G_l2 = SHG::getScalarsNormL2( G, exp_G );
+    trace.info() << "|He-H|_2  = " << stat_error_H.normL2() << std::endl;
+    trace.info() << "|He-H| mean=" << stat_error_H.mean()
+                 << " p50=" << stat_error_H.quantile( 0.5 )
+                 << " p90=" << stat_error_H.quantile( 0.9 )
+                 << " p99=" << stat_error_H.quantile( 0.99 ) << std::endl;
+    const auto stat_error_G = ErrorStatistics::compute( G, exp_G, pool );
     trace.info() << "|Ge-G|_oo = " << stat_error_G.max() << std::endl;
-    trace.info() << "|Ge-G|_2  = " << error_G_l2 << std::endl;
+    trace.info() << "|Ge-G|_2  = " << stat_error_G.normL2() << std::endl;
+    reportNumaLocality( pool );
 
     // Remove normals for better blocky display.
     smesh.vertexNormals() = SH::RealVectors();
@@ -150,18 +495,45 @@ int main( int argc, char* argv[] )
                                      fabs( *exp_H_min_max.second ) );
     const double    Gmax = std::max( fabs( *exp_G_min_max.first ),
                                      fabs( *exp_G_min_max.second ) );
-    const auto colormapH = makeQuantifiedColorMap( makeColorMap( -Hmax, Hmax ).first );
-    const auto colormapG = makeQuantifiedColorMap( makeColorMap( -Gmax, Gmax ).first );
-    auto colorsH = SMW::Colors( varifolds.size() );
-    auto colorsG = SMW::Colors( varifolds.size() );
-    for ( auto i = 0; i < varifolds.size(); i++ )
+    // 50 entries: the quantification of QuantifiedColorMap.
+    const ColorLookupTable colormapH( makeColorMap( -Hmax, Hmax ).first, 50 );
+    const ColorLookupTable colormapG( makeColorMap( -Gmax, Gmax ).first, 50 );
+    const SMW::Colors colorsH = colormapH.colors( H, pool );
+    const SMW::Colors colorsG = colormapG.colors( G, pool );
+
+    // The exports are written on the I/O queue, from a copy of the mesh,
+    // while the rest of the evaluation goes on.
+    IOQueue& io = sharedIOQueue();
+    std::vector< std::future<void> > exports;
+    const auto exportedMesh = std::make_shared<SM>( smesh );
+    exports.push_back( io.submit( [ exportedMesh, colorsH ]
     {
-        colorsH[ i ] = colormapH( H[ i ] );
-        colorsG[ i ] = colormapG( G[ i ] );
-    }
+        if ( !SMW::writeOBJ( "example-cnc-H", *exportedMesh, colorsH ) )
+            throw std::runtime_error( "unable to write example-cnc-H.obj" );
+    } ) );
+    exports.push_back( io.submit( [ exportedMesh, colorsG ]
+    {
+        if ( !SMW::writeOBJ( "example-cnc-G", *exportedMesh, colorsG ) )
+            throw std::runtime_error( "unable to write example-cnc-G.obj" );
+    } ) );
 
-    SMW::writeOBJ( "example-cnc-H", smesh, colorsH );
-    SMW::writeOBJ( "example-cnc-G", smesh, colorsG );
+    if ( args.has( "features" ) )
+    {
+        // One line per feature, handed over as soon as it is complete:
+        // sign, max |H|, number of elements, then the elements.
+        AsyncFileWriter output( io, "example-cnc-features.txt" );
+        const auto nbFeatures = extractCurvatureFeatures( smesh, H, method, args.getDouble( "features", 0. ),
+                [ &output ] ( FeatureComponent&& component )
+                {
+                    std::ostringstream line;
+                    line << component.sign << " " << component.maxNorm << " " << component.elements.size();
+                    for ( const auto e : component.elements ) line << " " << e;
+                    line << "\n";
+                    output << line.str();
+                }, static_cast<size_t>( args.getDouble( "feature-size", 1. ) ), pool );
+        exports.push_back( output.close() );
+        trace.info() << nbFeatures << " features written to example-cnc-features.txt" << std::endl;
+    }
 
 
     if (checkCNC) {
@@ -194,23 +566,36 @@ int main( int argc, char* argv[] )
         std::cout << "CNC computed Gaussian curvatures:"
                   << " min=" << *G_CNC_min_max.first << " max=" << *G_CNC_min_max.second
                   << std::endl;
-        const auto      error_H_CNC = SHG::getScalarsAbsoluteDifference( H_CNC, exp_H );
-        const auto stat_error_H_CNC = SHG::getStatistic( error_H_CNC );
-        const auto   error_H_CNC_l2 = SHG::getScalarsNormL2( H_CNC, exp_H );
+        const auto stat_error_H_CNC = ErrorStatistics::compute( H_CNC, exp_H, pool );
         trace.info() << "|He-H_CNC|_oo = " << stat_error_H_CNC.max() << std::endl;
-        trace.info() << "|He-H_CNC|_2  = " << error_H_CNC_l2 << std::endl;
-        const auto      error_G_CNC = SHG::getScalarsAbsoluteDifference( G_CNC, exp_G );
-        const auto stat_error_G_CNC = SHG::getStatistic( error_G_CNC );
-        const auto   error_G_CNC_l2 = SHG::getScalarsNormL2( G_CNC, exp_G );
+        trace.info() << "|He-H_CNC|_2  = " << stat_error_H_CNC.normL2() << std::endl;
+        const auto stat_error_G_CNC = ErrorStatistics::compute( G_CNC, exp_G, pool );
         trace.info() << "|Ge-G_CNC|_oo = " << stat_error_G_CNC.max() << std::endl;
-        trace.info() << "|Ge-G_CNC|_2  = " << error_G_CNC_l2 << std::endl;
+        trace.info() << "|Ge-G_CNC|_2  = " << stat_error_G_CNC.normL2() << std::endl;
         polysurf->addFaceScalarQuantity("CNC H", H_CNC );
     }
 
     //polysurf->addFaceColorQuantity("Error H He-H", colorErrorH);
     polysurf->addFaceScalarQuantity("Computed H", H );
     polysurf->addFaceScalarQuantity("True H", exp_H );
-    polysurf->addFaceScalarQuantity("Error H He-H", error_H );
+    // Polyscope copies the fields it registers: the error field is
+    // computed in place of the expected one, without another vector.
+    pool.parallelFor( 0, exp_H.size(), 16384, [ & ] ( size_t i, size_t j )
+    {
+        for ( auto k = i; k < j; ++k ) exp_H[ k ] = fabs( H[ k ] - exp_H[ k ] );
+    } );
+    polysurf->addFaceScalarQuantity("Error H He-H", exp_H );
+    for ( auto& e : exports )
+    {
+        try
+        {
+            e.get();
+        }
+        catch ( const std::exception& error )
+        {
+            trace.warning() << error.what() << std::endl;
+        }
+    }
     polyscope::show();
 
 
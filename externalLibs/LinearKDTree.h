@@ -252,11 +252,29 @@ public:
   Indices
   pointsInBall( const Point p, const Scalar rho, const Size nb_expected = 50 ) const
   {
-    typedef std::tuple< Index, Index, int > Node;
-    const Scalar rho2 = rho * rho;
     Indices output;
     output.reserve( nb_expected );
-    if ( _indices.empty() ) return output;
+    pointsInBall( p, rho, output );
+    return output;
+  }
+
+  /// Localization query that outputs all the points within a ball in
+  /// a given container, so that its memory can be reused from one
+  /// query to the next.
+  ///
+  /// @param[in] p any point of the space
+  /// @param[in] rho any non-negative value
+  /// @param[out] output any container of indices with \c clear and
+  /// \c push_back, cleared first, that receives the indices of all
+  /// the points within the ball of center \a p and radius \a rho.
+  template < typename TOutput >
+  void
+  pointsInBall( const Point p, const Scalar rho, TOutput& output ) const
+  {
+    typedef std::tuple< Index, Index, int > Node;
+    const Scalar rho2 = rho * rho;
+    output.clear();
+    if ( _indices.empty() ) return;
     // Looks ugly, but allows searches in vector of points of 2^100 points.
     Node VQ[ 100 ];
     std::size_t t = 1;
@@ -280,7 +298,6 @@ public:
       if ( ( p[ a ] <= v + rho ) )
         VQ[ t++ ] = { i, m, na };
     }
-    return output;
   }
 
   /// Localization query that returns at least the \a k nearest
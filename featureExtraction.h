@@ -0,0 +1,102 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "threadPool.h"
+#include "unionFind.h"
+
+/// Connected set of elements of high curvature of the same sign: a ridge
+/// (positive) or a valley (negative).
+struct FeatureComponent {
+    std::vector<size_t> elements;
+    int sign;
+    double maxNorm; ///< largest absolute signed norm
+};
+
+/**
+ * Extracts the features of a field of signed curvature norms: elements
+ * whose absolute norm is at least \a threshold, connected through \a
+ * neighbors (a callable returning the adjacent elements of an element)
+ * when their norms have the same sign.
+ *
+ * The selection and the gathering of the adjacencies run in parallel.
+ * The components are then grown by a sweep over the element indices with
+ * a union-find, and each one is passed to \a emit as soon as the sweep
+ * is past all the neighbors of its elements, i.e. as soon as it cannot
+ * grow anymore, so that a consumer processes the first components while
+ * the others are being grown. Components with less than \a minSize
+ * elements are dropped.
+ *
+ * @return the number of emitted components.
+ */
+template <typename Neighbors>
+size_t extractFeatures(const std::vector<double>& signedNorms, const double threshold, const Neighbors& neighbors,
+                       const std::function<void(FeatureComponent&&)>& emit, ThreadPool& pool, const size_t minSize = 1) {
+    const size_t n = signedNorms.size();
+    const auto signOf = [&](const size_t i) { return signedNorms[i] < 0 ? -1 : 1; };
+    std::vector<char> selected(n);
+    pool.parallelFor(0, n, 4096, [&](size_t begin, size_t end) {
+        for (auto i = begin; i < end; ++i) selected[i] = std::abs(signedNorms[i]) >= threshold;
+    });
+    // Last index the sweep must reach before the component of an element
+    // is complete: its largest connected neighbor.
+    std::vector<size_t> last(n);
+    pool.parallelFor(0, n, 4096, [&](size_t begin, size_t end) {
+        for (auto i = begin; i < end; ++i) {
+            last[i] = i;
+            if (!selected[i]) continue;
+            for (const auto j : neighbors(i)) {
+                if (selected[j] && signOf(j) == signOf(i)) last[i] = std::max<size_t>(last[i], j);
+            }
+        }
+    });
+
+    UnionFind sets(n);
+    // Elements of a component as a list threaded through next, from the
+    // root to tail[root].
+    std::vector<size_t> next(n, n), tail(n);
+    typedef std::pair<size_t, size_t> Due; // (last, root)
+    std::priority_queue<Due, std::vector<Due>, std::greater<Due>> due;
+    size_t nbEmitted = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (selected[i]) {
+            tail[i] = i;
+            for (const auto j : neighbors(i)) {
+                if (j >= i || !selected[j] || signOf(j) != signOf(i)) continue;
+                const auto merged = sets.unite(i, j);
+                if (merged.first == merged.second) continue;
+                const auto root = merged.first, absorbed = merged.second;
+                next[tail[root]] = absorbed;
+                tail[root] = tail[absorbed];
+                last[root] = std::max(last[root], last[absorbed]);
+            }
+            const auto root = sets.find(i);
+            due.push({last[root], root});
+        }
+        // Entries are stale once their root was absorbed or extended.
+        while (!due.empty() && due.top().first <= i) {
+            const auto top = due.top();
+            due.pop();
+            const auto root = top.second;
+            if (sets.find(root) != root || last[root] != top.first || tail[root] == n) continue;
+            if (sets.size(root) >= minSize) {
+                FeatureComponent component;
+                component.sign = signOf(root);
+                component.maxNorm = 0.;
+                component.elements.reserve(sets.size(root));
+                for (auto e = root; e != n; e = next[e]) {
+                    component.elements.push_back(e);
+                    component.maxNorm = std::max(component.maxNorm, std::abs(signedNorms[e]));
+                }
+                emit(std::move(component));
+                ++nbEmitted;
+            }
+            tail[root] = n; // emitted
+        }
+    }
+    return nbEmitted;
+}
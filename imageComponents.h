@@ -0,0 +1,111 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <vector>
+
+#include "threadPool.h"
+#include "unionFind.h"
+
+/// Voxels [x0, x1) of the row (y, z) of a volume.
+struct VoxelRun {
+    int x0, x1, y, z;
+};
+
+/// 6-connected component of the foreground of a volume.
+struct ImageComponent {
+    std::vector<VoxelRun> runs;
+    size_t nbVoxels = 0;
+    std::array<int, 3> lower; ///< bounding box, inclusive
+    std::array<int, 3> upper;
+};
+
+/**
+ * Labels the 6-connected components of the foreground voxels of the box
+ * [\a lower, \a upper] (inclusive), \a isSet(x, y, z) telling whether a
+ * voxel is in the foreground. The foreground is encoded as runs along x,
+ * extracted row by row in parallel; the runs overlapping in consecutive
+ * rows are merged with a union-find, in parallel over slabs of z and
+ * then across the slabs.
+ *
+ * @return the components with at least \a minVoxels voxels, largest first.
+ */
+template <typename IsSet>
+std::vector<ImageComponent> labelComponents(const std::array<int, 3>& lower, const std::array<int, 3>& upper, const IsSet& isSet,
+                                            ThreadPool& pool, const size_t minVoxels = 1) {
+    const int ny = upper[1] - lower[1] + 1, nz = upper[2] - lower[2] + 1;
+    if (upper[0] < lower[0] || ny <= 0 || nz <= 0) return {};
+    const size_t nbRows = static_cast<size_t>(ny) * nz;
+    std::vector<std::vector<VoxelRun>> rowRuns(nbRows);
+    pool.parallelFor(0, nbRows, 64, [&](size_t begin, size_t end) {
+        for (auto r = begin; r < end; ++r) {
+            const int y = lower[1] + static_cast<int>(r % ny), z = lower[2] + static_cast<int>(r / ny);
+            for (int x = lower[0]; x <= upper[0]; ++x) {
+                if (!isSet(x, y, z)) continue;
+                const int x0 = x;
+                while (x <= upper[0] && isSet(x, y, z)) ++x;
+                rowRuns[r].push_back({x0, x, y, z});
+            }
+        }
+    });
+    std::vector<size_t> rowStart(nbRows + 1, 0);
+    for (size_t r = 0; r < nbRows; ++r) rowStart[r + 1] = rowStart[r] + rowRuns[r].size();
+    std::vector<VoxelRun> runs(rowStart[nbRows]);
+    pool.parallelFor(0, nbRows, 256, [&](size_t begin, size_t end) {
+        for (auto r = begin; r < end; ++r) {
+            std::copy(rowRuns[r].begin(), rowRuns[r].end(), runs.begin() + rowStart[r]);
+            rowRuns[r] = std::vector<VoxelRun>();
+        }
+    });
+
+    UnionFind sets(runs.size());
+    // Unites the overlapping runs of the rows a and b.
+    const auto uniteRows = [&](const size_t a, const size_t b) {
+        auto i = rowStart[a], j = rowStart[b];
+        while (i < rowStart[a + 1] && j < rowStart[b + 1]) {
+            if (runs[i].x0 < runs[j].x1 && runs[j].x0 < runs[i].x1) sets.unite(i, j);
+            if (runs[i].x1 < runs[j].x1) ++i; else ++j;
+        }
+    };
+    // Slabs only touch the runs of their own rows: they run concurrently.
+    const size_t nbSlabs = std::min<size_t>(nz, 4 * (pool.size() + 1));
+    pool.parallelFor(0, nbSlabs, 1, [&](size_t begin, size_t end) {
+        for (auto s = begin; s < end; ++s) {
+            const size_t z0 = nz * s / nbSlabs, z1 = nz * (s + 1) / nbSlabs;
+            for (auto z = z0; z < z1; ++z) {
+                for (size_t y = 0; y < static_cast<size_t>(ny); ++y) {
+                    const auto r = z * ny + y;
+                    if (y > 0) uniteRows(r, r - 1);
+                    if (z > z0) uniteRows(r, r - ny);
+                }
+            }
+        }
+    });
+    for (size_t s = 1; s < nbSlabs; ++s) {
+        const size_t z = nz * s / nbSlabs;
+        for (size_t y = 0; y < static_cast<size_t>(ny); ++y) uniteRows(z * ny + y, (z - 1) * ny + y);
+    }
+
+    std::vector<size_t> componentOfRoot(runs.size(), runs.size());
+    std::vector<ImageComponent> components;
+    for (size_t i = 0; i < runs.size(); ++i) {
+        const auto root = sets.find(i);
+        if (componentOfRoot[root] == runs.size()) {
+            componentOfRoot[root] = components.size();
+            components.emplace_back();
+            components.back().lower = {{runs[i].x0, runs[i].y, runs[i].z}};
+            components.back().upper = {{runs[i].x1 - 1, runs[i].y, runs[i].z}};
+        }
+        auto& component = components[componentOfRoot[root]];
+        const auto& run = runs[i];
+        component.runs.push_back(run);
+        component.nbVoxels += run.x1 - run.x0;
+        component.lower = {{std::min(component.lower[0], run.x0), std::min(component.lower[1], run.y), std::min(component.lower[2], run.z)}};
+        component.upper = {{std::max(component.upper[0], run.x1 - 1), std::max(component.upper[1], run.y), std::max(component.upper[2], run.z)}};
+    }
+    components.erase(std::remove_if(components.begin(), components.end(),
+                                    [&](const ImageComponent& c) { return c.nbVoxels < minVoxels; }),
+                     components.end());
+    std::sort(components.begin(), components.end(),
+              [](const ImageComponent& a, const ImageComponent& b) { return a.nbVoxels > b.nbVoxels; });
+    return components;
+}
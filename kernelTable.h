@@ -0,0 +1,111 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Lookup table of the exponential kernel rho(r) = exp(-a/(1-r^2))
+ * and of its derivative, indexed by s = r^2 in [0,1] so that no square
+ * root is needed. The derivative is stored as rho'(r)/r, a function of
+ * s only. Values between nodes are obtained by cubic Hermite
+ * interpolation from the exact values and slopes at the nodes.
+ *
+ * The maximum interpolation error, measured on a fine sampling at
+ * construction, is available through \ref maxError and \ref
+ * maxDerivativeError.
+ */
+class ExponentialKernelTable {
+public:
+    ExponentialKernelTable(const double a, const size_t nbIntervals = 1024)
+            : a(a), nbIntervals(nbIntervals), step(1.0 / nbIntervals) {
+        values.resize(nbIntervals + 1);
+        slopes.resize(nbIntervals + 1);
+        derivatives.resize(nbIntervals + 1);
+        derivativeSlopes.resize(nbIntervals + 1);
+        for (size_t i = 0; i <= nbIntervals; ++i) {
+            const double s = i * step;
+            values[i] = exactValue(s);
+            derivatives[i] = exactDerivative(s);
+            if (s < 1.0) {
+                const double d = 1 - s;
+                slopes[i] = -a * values[i] / (d * d) * step;
+                derivativeSlopes[i] = -2 * a * (slopes[i] / step / (d * d) + 2 * values[i] / (d * d * d)) * step;
+            } else {
+                slopes[i] = derivativeSlopes[i] = 0.;
+            }
+        }
+        measureErrors();
+    }
+
+    /// @return the cached table for the parameter \a a.
+    static const ExponentialKernelTable& get(const double a) {
+        static std::mutex mutex;
+        static std::map<double, std::unique_ptr<ExponentialKernelTable>> tables;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& table = tables[a];
+        if (!table) table.reset(new ExponentialKernelTable(a));
+        return *table;
+    }
+
+    /// @return rho(r) for s = r^2.
+    double value(const double s) const {
+        return interpolate(values, slopes, s);
+    }
+
+    /// @return rho'(r) for s = r^2.
+    double derivative(const double s, const double r) const {
+        return r * interpolate(derivatives, derivativeSlopes, s);
+    }
+
+    double parameter() const { return a; }
+    double maxError() const { return valueError; }
+    double maxDerivativeError() const { return derivativeError; }
+
+    double exactValue(const double s) const {
+        return s < 1.0 ? std::exp(-a / (1 - s)) : 0.;
+    }
+
+    /// @return rho'(r)/r for s = r^2.
+    double exactDerivative(const double s) const {
+        if (s >= 1.0) return 0.;
+        const double d = 1 - s;
+        return -2 * a * std::exp(-a / d) / (d * d);
+    }
+
+private:
+    /// Branch-free, so that the batched kernels vectorize it: s is
+    /// clamped to [0,1], and the last node, where the kernel and its
+    /// slopes vanish, gives 0 for s >= 1.
+    double interpolate(const std::vector<double>& f, const std::vector<double>& df, const double s) const {
+        const double x = std::min(std::max(0., s), 1.) * nbIntervals;
+        const auto i = static_cast<int>(std::min(x, nbIntervals - 1.));
+        const double t = x - i;
+        const double t2 = t * t;
+        const double t3 = t2 * t;
+        return (2 * t3 - 3 * t2 + 1) * f[i] + (t3 - 2 * t2 + t) * df[i]
+               + (-2 * t3 + 3 * t2) * f[i + 1] + (t3 - t2) * df[i + 1];
+    }
+
+    void measureErrors() {
+        valueError = derivativeError = 0.;
+        const size_t nbSamples = 16 * nbIntervals;
+        for (size_t k = 0; k < nbSamples; ++k) {
+            const double s = (k + 0.5) / nbSamples;
+            valueError = std::max(valueError, std::fabs(value(s) - exactValue(s)));
+            derivativeError = std::max(derivativeError, std::fabs(interpolate(derivatives, derivativeSlopes, s) - exactDerivative(s)));
+        }
+    }
+
+    double a;
+    size_t nbIntervals;
+    double step;
+    std::vector<double> values;
+    std::vector<double> slopes;           ///< d(value)/ds times the step
+    std::vector<double> derivatives;
+    std::vector<double> derivativeSlopes; ///< d(derivative)/ds times the step
+    double valueError = 0.;
+    double derivativeError = 0.;
+};
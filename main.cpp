@@ -1,55 +1,294 @@
 #include "core.cpp"
 
-int main(int argc, char** argv)
-{
-    polyscope::init();
-
-    auto params = SH3::defaultParameters() | SHG3::defaultParameters();
-    std::string filename = argc > 1 ? argv[1] : "../DGtalObjects/bunny66.vol";
-    double radius = argc > 2 ? std::atof( argv[2] ) : 10.0;
+#include <map>
+#include <tuple>
 
-    auto distribType = argc > 3 ? argToDistribType(argv[3]) : DistributionType::Polynomial;
+#include "imgui.h"
 
-    auto binImage = SH3::makeBinaryImage(filename, params);
-    auto K = SH3::getKSpace(binImage);
-    auto surface = SH3::makeDigitalSurface(binImage, K, params);
-    auto primalSurface = *SH3::makePrimalSurfaceMesh(surface);
+#include "backgroundJobs.h"
 
-    auto polyBunny = registerSurface(primalSurface, "bunny");
+/// Fields shown by the viewer for a method.
+struct MethodResults {
+    std::vector<Varifold> varifolds;
+    std::vector<RealVector> lcs;
+    std::vector<double> lcsNorm;
+    std::vector<ColorLookupTable::RGB> colorLcsNorm;
+    std::vector<RealVector> lodLcs;                  ///< per triangle of the display mesh, if decimated
+    std::vector<ColorLookupTable::RGB> lodColorLcsNorm;
+    std::vector<double> featureLabels; ///< component of each element, -1 outside features
+};
 
-    for (auto m: {Method::TrivialNormalFaceCentroid, Method::DualNormalVertexPosition, Method::CorrectedNormalFaceCentroid}) {
-        auto varifolds = computeVarifolds(binImage, surface, radius, distribType, m);
-
-        auto nbElements = m == Method::DualNormalVertexPosition ? primalSurface.nbVertices() : primalSurface.nbFaces();
+/// Labels the features of \a r, logging them as they are extracted.
+void computeFeatures(MethodResults& r, const SH3::SurfaceMesh& mesh, const Method m, const double threshold, ThreadPool& pool) {
+    r.featureLabels.assign(r.lcsNorm.size(), -1.);
+    size_t nbElements = 0;
+    const auto nbFeatures = extractCurvatureFeatures(mesh, r.lcsNorm, m, threshold, [&, label = 0.](FeatureComponent&& component) mutable {
+        for (const auto e : component.elements) r.featureLabels[e] = label;
+        nbElements += component.elements.size();
+        label += 1.;
+    }, 1, pool);
+    DGtal::trace.info() << methodToString(m) << ": " << nbFeatures << " features over " << nbElements << " elements" << std::endl;
+}
 
-        std::vector<RealVector> lcs;
-        for (auto i = 0; i < nbElements; i++) {
-            lcs.push_back(varifolds[i].curvature);
+/// Computes the displayed fields of \a r, aggregated on \a lod when the
+/// display mesh is decimated.
+void computeColors(MethodResults& r, const ClusteredMesh* lod, ThreadPool& pool) {
+    r.lcs.reserve(r.varifolds.size());
+    for (const auto& varifold : r.varifolds) {
+        r.lcs.push_back(varifold.curvature);
+    }
+    auto minmax = std::minmax_element(r.lcsNorm.begin(), r.lcsNorm.end());
+    const auto colormap = makeColorLookupTable(*minmax.first, *minmax.second);
+    if (lod) {
+        std::vector<RealPoint> positions;
+        positions.reserve(r.varifolds.size());
+        for (const auto& varifold : r.varifolds) {
+            positions.push_back(varifold.position);
         }
+        r.lodLcs = lod->aggregate(positions, r.lcs, pool);
+        r.lodColorLcsNorm = colormap.rgb(lod->aggregate(positions, r.lcsNorm, pool), pool);
+    } else {
+        r.colorLcsNorm = colormap.rgb(r.lcsNorm, pool);
+    }
+}
+
+/// Adds the fields of \a r to \a mesh as "<name> Local Curvatures" and
+/// "<name> Local Curvatures Norm". @return the color quantity.
+polyscope::Quantity* displayResults(PolyMesh* mesh, const Method m, const MethodResults& r, const std::string& name) {
+    auto minmax = std::minmax_element(r.lcsNorm.begin(), r.lcsNorm.end());
+    DGtal::trace.info() << name << " Min: " << *minmax.first << " Max: " << *minmax.second << std::endl;
+    if (!r.lodColorLcsNorm.empty()) {
+        mesh->addFaceVectorQuantity(name + " Local Curvatures", r.lodLcs);
+        return mesh->addFaceColorQuantity(name + " Local Curvatures Norm", r.lodColorLcsNorm);
+    }
+    if (!r.featureLabels.empty()) {
         if (m == Method::DualNormalVertexPosition) {
-            polyBunny->addVertexVectorQuantity(methodToString(m) + " Local Curvatures", lcs);
+            mesh->addVertexScalarQuantity(name + " Features", r.featureLabels);
         } else {
-            polyBunny->addFaceVectorQuantity(methodToString(m) + " Local Curvatures", lcs);
+            mesh->addFaceScalarQuantity(name + " Features", r.featureLabels);
+        }
+    }
+    if (m == Method::DualNormalVertexPosition) {
+        mesh->addVertexVectorQuantity(name + " Local Curvatures", r.lcs);
+        return mesh->addVertexColorQuantity(name + " Local Curvatures Norm", r.colorLcsNorm);
+    }
+    mesh->addFaceVectorQuantity(name + " Local Curvatures", r.lcs);
+    return mesh->addFaceColorQuantity(name + " Local Curvatures Norm", r.colorLcsNorm);
+}
+
+/**
+ * Viewer panel recomputing the curvatures of a method, a kernel and a
+ * radius chosen interactively. Each change submits a job to a \ref
+ * LatestJobRunner, which drops the stale ones; the job reuses the mesh and
+ * normals of the input and the results of parameters already computed.
+ * The panel polls for the result at each frame and shows it as the
+ * "Interactive" quantities, so that the viewer stays responsive.
+ */
+class InteractivePanel {
+public:
+    InteractivePanel(const CurvatureEngineInput& input, PolyMesh* mesh, const ClusteredMesh* lod, const double radius,
+                     const DistributionType distribType, const VarifoldOptions& options, ThreadPool& pool)
+            : input(input), mesh(mesh), lod(lod), kernel(distribType), radius(radius), options(options), pool(pool), runner(pool) {}
+
+    /// Draws the panel; called by polyscope at each frame.
+    void operator()() {
+        static const char* const methodNames[] = {"Trivial Normal Face Centroid", "Dual Normal Vertex Position",
+                                                  "Corrected Normal Face Centroid", "Probabilistic Of Trivials",
+                                                  "Vertex Interpolation"};
+        static const char* const kernelNames[] = {"Linear", "Polynomial", "Exponential", "Tabulated exponential"};
+        bool changed = ImGui::Combo("Method", &method, methodNames, 5);
+        changed |= ImGui::Combo("Kernel", &kernel, kernelNames, 4);
+        changed |= ImGui::InputDouble("Radius", &radius, 1.0, 5.0);
+        if (changed && radius > 0) submit();
+        std::shared_ptr<const Computed> computed;
+        try {
+            if (runner.poll(computed)) {
+                displayResults(mesh, computed->method, computed->results, "Interactive")->setEnabled(true);
+            }
+        } catch (const std::exception& e) {
+            DGtal::trace.error() << "Interactive computation failed: " << e.what() << std::endl;
         }
+        ImGui::TextUnformatted(runner.busy() ? "Computing..." : "Up to date");
+    }
+
+private:
+    struct Computed {
+        Method method;
+        MethodResults results;
+    };
+    typedef std::tuple<int, int, double> Key;
 
-        const auto lcsNorm = computeSignedNorms(primalSurface, varifolds, m);
+    void submit() {
+        const Key key(method, kernel, radius);
+        runner.submit([this, key](const CancellationToken& token) {
+            // Jobs run one at a time: the cache needs no lock.
+            const auto cached = cache.find(key);
+            if (cached != cache.end()) return cached->second;
+            const auto m = static_cast<Method>(std::get<0>(key));
+            auto computed = std::make_shared<Computed>();
+            computed->method = m;
+            auto& r = computed->results;
+            auto jobOptions = options;
+            jobOptions.cancellation = token;
+            r.varifolds = computeVarifolds(input, std::get<2>(key), static_cast<DistributionType>(std::get<1>(key)), m, 1.0, jobOptions, pool);
+            r.lcsNorm = computeSignedNorms(input.mesh, r.varifolds, m, pool, token);
+            token.check();
+            computeColors(r, lod, pool);
+            if (cache.size() > 16) cache.clear();
+            cache[key] = computed;
+            return std::shared_ptr<const Computed>(computed);
+        });
+    }
 
+    const CurvatureEngineInput& input;
+    PolyMesh* mesh;
+    const ClusteredMesh* lod;
+    int method = Method::CorrectedNormalFaceCentroid;
+    int kernel;
+    double radius;
+    const VarifoldOptions options;
+    ThreadPool& pool;
+    std::map<Key, std::shared_ptr<const Computed>> cache;
+    LatestJobRunner<std::shared_ptr<const Computed>> runner; ///< last member: its jobs use the others
+};
 
-        auto minmax = std::minmax_element(lcsNorm.begin(), lcsNorm.end());
-        DGtal::trace.info() << "Min: " << *minmax.first << " Max: " << *minmax.second << std::endl;
-        const auto colormap = makeColorMap(*minmax.first, *minmax.second);
-        std::vector<std::vector<double>> colorLcsNorm;
-        for (auto i = 0; i < nbElements; i++) {
-            const auto color = lcsNorm[i] < 0 ? colormap.first(lcsNorm[i]) : colormap.second(lcsNorm[i]);
-            colorLcsNorm.push_back({static_cast<double>(color.red())/255, static_cast<double>(color.green())/255, static_cast<double>(color.blue())/255});
+int main(int argc, char** argv)
+{
+    auto params = SH3::defaultParameters() | SHG3::defaultParameters();
+    const CommandLine args(argc, argv);
+    const auto& pargs = args.positional;
+    argsToSharedThreadPool(args);
+    std::string filename = pargs.size() > 1 ? pargs[1] : "../DGtalObjects/bunny66.vol";
+    double radius = pargs.size() > 2 ? std::atof( pargs[2].c_str() ) : 10.0;
+
+    auto distribType = pargs.size() > 3 ? argToDistribType(pargs[3]) : DistributionType::Polynomial;
+    const auto options = argsToVarifoldOptions(args);
+    reportKernel(distribType, options);
+
+    ThreadPool& pool = sharedThreadPool();
+    // With --sparse, a .vol file is read as runs and meshed from them,
+    // without a dense image: the methods needing one are skipped. The
+    // volume is read on the I/O queue while the viewer initializes.
+    std::unique_ptr<RunLengthVolume> sparse;
+    auto loading = sharedIOQueue().submit([&] {
+        if (args.has("sparse")) {
+            sparse.reset(new RunLengthVolume());
+            if (loadRunLengthVolume(filename, params, *sparse, pool)) return CountedPtr<SH3::BinaryImage>();
+            sparse.reset();
         }
-        if (m == Method::DualNormalVertexPosition) {
-            polyBunny->addVertexColorQuantity(methodToString(m) + " Local Curvatures Norm", colorLcsNorm);
-        } else {
-            polyBunny->addFaceColorQuantity(methodToString(m) + " Local Curvatures Norm", colorLcsNorm);
+        return loadBinaryImage(filename, params, pool);
+    });
+    polyscope::init();
+    auto binImage = loading.get();
+    if (!sparse && binImage == nullptr) {
+        DGtal::trace.error() << "Unable to read " << filename << std::endl;
+        return 1;
+    }
+
+    // A part of the volume shown as its own mesh: the whole volume, or
+    // with --components [min voxels], each connected component.
+    struct Part {
+        std::string name;
+        CountedPtr<SH3::BinaryImage> image;
+        std::unique_ptr<CurvatureEngineInput> input;
+        ClusteredMesh lod;
+        PolyMesh* mesh = nullptr;
+        std::vector<MethodResults> results;
+    };
+    std::vector<CountedPtr<SH3::BinaryImage>> images;
+    if (sparse) {
+        if (sparse->nbRuns() == 0) {
+            DGtal::trace.error() << "No foreground voxels in " << filename << std::endl;
+            return 1;
+        }
+        images.emplace_back();
+    } else if (args.has("components")) {
+        images = splitComponents(binImage, static_cast<size_t>(std::max(1., args.getDouble("components", 1.))), pool);
+        binImage = CountedPtr<SH3::BinaryImage>();
+    } else {
+        images.push_back(binImage);
+    }
+    if (images.empty()) {
+        DGtal::trace.error() << "No foreground voxels in " << filename << std::endl;
+        return 1;
+    }
+    std::vector<Part> parts(images.size());
+    for (size_t c = 0; c < parts.size(); ++c) {
+        parts[c].name = images.size() > 1 ? "bunny " + std::to_string(c) : "bunny";
+        parts[c].image = images[c];
+    }
+
+    // Each part is a chain surface -> (clustering, methods) and each method
+    // a chain varifolds -> signs -> colors -> display, all running
+    // concurrently on the pool; polyscope is only called from this thread.
+    // Parts are added largest first, hence started first, and each builds
+    // its own surface and indices.
+    std::vector<Method> methods = {Method::TrivialNormalFaceCentroid, Method::DualNormalVertexPosition, Method::CorrectedNormalFaceCentroid, Method::VertexInterpolation, Method::ProbabilisticOfTrivials};
+    if (sparse) methods.erase(std::find(methods.begin(), methods.end(), Method::CorrectedNormalFaceCentroid));
+    TaskGraph graph;
+    // With --lod <cell size>, the fields are shown on the mesh decimated
+    // by clustering its vertices per cell.
+    const double lodCellSize = args.getDouble("lod", 0.);
+    // With --features <threshold>, elements of absolute signed norm above
+    // the threshold are grouped into ridges and valleys.
+    const double featureThreshold = args.getDouble("features", 0.);
+    for (auto& part : parts) {
+        part.results.resize(methods.size());
+        // CountedPtr reference counts are not thread-safe: the handles of
+        // a part are only copied by the tasks of that part.
+        const auto surfaceTask = graph.add(part.name + " surface", [&] {
+            if (sparse) {
+                part.input.reset(new CurvatureEngineInput(makeSurfaceMesh(*sparse, pool)));
+                sparse.reset();
+                return;
+            }
+            auto K = SH3::getKSpace(part.image);
+            auto surface = SH3::makeDigitalSurface(part.image, K, params);
+            part.input.reset(new CurvatureEngineInput(part.image, surface));
+        });
+        const auto clustering = graph.add(part.name + " clustering", [&] {
+            if (lodCellSize > 0) part.lod = clusterMesh(part.input->mesh, lodCellSize, pool);
+        }, {surfaceTask});
+        const auto registration = graph.addOnMainThread(part.name + " registration", [&] {
+            if (lodCellSize > 0) {
+                DGtal::trace.info() << "Display mesh: " << part.lod.triangles.size() << " triangles for " << part.input->mesh.nbFaces() << " faces" << std::endl;
+                part.mesh = registerClusteredMesh(part.lod, part.name);
+            } else {
+                part.mesh = registerSurface(part.input->mesh, part.name);
+            }
+        }, {clustering});
+        const ClusteredMesh* displayLod = lodCellSize > 0 ? &part.lod : nullptr;
+        for (size_t k = 0; k < methods.size(); ++k) {
+            const auto m = methods[k];
+            auto& r = part.results[k];
+            const auto varifoldsTask = graph.add(methodToString(m) + " varifolds", [&, m] {
+                r.varifolds = computeVarifolds(*part.input, radius, distribType, m, 1.0, options, pool);
+            }, {surfaceTask});
+            const auto signsTask = graph.add(methodToString(m) + " signs", [&, m] {
+                r.lcsNorm = computeSignedNorms(part.input->mesh, r.varifolds, m, pool);
+            }, {varifoldsTask});
+            const auto colorsTask = graph.add(methodToString(m) + " colors", [&, displayLod] {
+                computeColors(r, displayLod, pool);
+            }, {signsTask, clustering});
+            // Features are labeled on the full mesh, hence not shown on a
+            // decimated one.
+            const auto featuresTask = graph.add(methodToString(m) + " features", [&, m, displayLod] {
+                if (featureThreshold > 0 && !displayLod) computeFeatures(r, part.input->mesh, m, featureThreshold, pool);
+            }, {signsTask});
+            graph.addOnMainThread(methodToString(m) + " display", [&, m] {
+                displayResults(part.mesh, m, r, methodToString(m));
+            }, {colorsTask, featuresTask, registration});
         }
     }
+    graph.run(pool);
+    DGtal::trace.info() << "Pipeline: " << graph.wall() << " ms wall, " << graph.longestChain() << " ms longest chain, "
+                        << graph.total() << " ms of tasks" << std::endl;
 
+    // The panel recomputes the largest part.
+    auto& largest = parts.front();
+    InteractivePanel panel(*largest.input, largest.mesh, lodCellSize > 0 ? &largest.lod : nullptr, radius, distribType, options, pool);
+    polyscope::state::userCallback = [&] { panel(); };
     polyscope::show();
+    polyscope::state::userCallback = nullptr;
     return 0;
 }
@@ -0,0 +1,209 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * @file monotonicArena.h
+ *
+ * Monotonic arenas for the short-lived scratch containers of the engine
+ * (neighbor indices, kernel weights, output builders). Allocations bump a
+ * pointer in large blocks and are never freed one by one: the memory is
+ * reclaimed at once when an \ref ArenaScope ends, and the blocks are kept
+ * for the next scope. Each thread owns an arena (\ref threadArena), so
+ * that once the blocks are large enough, scratch allocations do not reach
+ * the heap anymore.
+ *
+ * Each arena counts its own allocations, so that the allocation path
+ * writes no memory shared with other threads; \ref arenaStatistics sums
+ * the counters of all the arenas when reporting.
+ */
+
+/// Counters of the arenas.
+struct ArenaStatistics {
+    uint64_t allocations = 0; ///< allocations served by arenas
+    uint64_t heapBlocks = 0;  ///< blocks allocated on the heap
+    uint64_t heapBytes = 0;   ///< bytes of those blocks
+};
+
+class MonotonicArena;
+
+/// The live arenas, and the counters of the destroyed ones.
+struct ArenaRegistry {
+    std::mutex mutex;
+    std::unordered_set<const MonotonicArena*> arenas;
+    ArenaStatistics retired;
+};
+
+inline ArenaRegistry& arenaRegistry() {
+    static ArenaRegistry registry;
+    return registry;
+}
+
+class MonotonicArena {
+public:
+    /// Position in the arena, to rewind to.
+    struct Mark {
+        size_t block;
+        size_t offset;
+    };
+
+    explicit MonotonicArena(const size_t blockSize = 1 << 20) : blockSize(blockSize) {
+        auto& registry = arenaRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.arenas.insert(this);
+    }
+
+    MonotonicArena(const MonotonicArena&) = delete;
+    MonotonicArena& operator=(const MonotonicArena&) = delete;
+
+    ~MonotonicArena() {
+        auto& registry = arenaRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.arenas.erase(this);
+        const auto counted = statistics();
+        registry.retired.allocations += counted.allocations;
+        registry.retired.heapBlocks += counted.heapBlocks;
+        registry.retired.heapBytes += counted.heapBytes;
+    }
+
+    void* allocate(const size_t bytes, const size_t alignment) {
+        increment(allocations, 1);
+        for (;;) {
+            while (current < blocks.size()) {
+                auto& block = blocks[current];
+                const auto base = reinterpret_cast<uintptr_t>(block.data.get());
+                const auto start = (base + offset + alignment - 1) / alignment * alignment - base;
+                if (start + bytes <= block.size) {
+                    offset = start + bytes;
+                    return block.data.get() + start;
+                }
+                ++current;
+                offset = 0;
+            }
+            const auto size = std::max(blockSize, bytes + alignment);
+            blocks.push_back({std::unique_ptr<char[]>(new char[size]), size});
+            increment(heapBlocks, 1);
+            increment(heapBytes, size);
+            current = blocks.size() - 1;
+            offset = 0;
+        }
+    }
+
+    /// Monotonic: memory is only reclaimed by \ref rewind.
+    void deallocate(void*, size_t) {}
+
+    Mark mark() const { return {current, offset}; }
+
+    /// Releases everything allocated since \a m, keeping the blocks.
+    void rewind(const Mark m) {
+        current = m.block;
+        offset = m.offset;
+    }
+
+    size_t capacity() const {
+        size_t total = 0;
+        for (const auto& block : blocks) total += block.size;
+        return total;
+    }
+
+    /// @return the counters of this arena; may be called from any thread.
+    ArenaStatistics statistics() const {
+        ArenaStatistics counted;
+        counted.allocations = allocations.load(std::memory_order_relaxed);
+        counted.heapBlocks = heapBlocks.load(std::memory_order_relaxed);
+        counted.heapBytes = heapBytes.load(std::memory_order_relaxed);
+        return counted;
+    }
+
+private:
+    /// Only the owning thread writes the counters: a plain load and store
+    /// suffice, and other threads only read them.
+    static void increment(std::atomic<uint64_t>& counter, const uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    size_t blockSize;
+    std::vector<Block> blocks;
+    size_t current = 0;
+    size_t offset = 0;
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> heapBlocks{0};
+    std::atomic<uint64_t> heapBytes{0};
+};
+
+/// @return the counters summed over all the arenas, live or destroyed.
+inline ArenaStatistics arenaStatistics() {
+    auto& registry = arenaRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    auto total = registry.retired;
+    for (const auto arena : registry.arenas) {
+        const auto counted = arena->statistics();
+        total.allocations += counted.allocations;
+        total.heapBlocks += counted.heapBlocks;
+        total.heapBytes += counted.heapBytes;
+    }
+    return total;
+}
+
+/// @return the arena of the calling thread.
+inline MonotonicArena& threadArena() {
+    static thread_local MonotonicArena arena;
+    return arena;
+}
+
+/// Rewinds an arena to its state at construction when destroyed. Scopes
+/// nest, as chunks of nested parallel loops run on the same thread.
+class ArenaScope {
+public:
+    explicit ArenaScope(MonotonicArena& arena = threadArena()) : arena(arena), start(arena.mark()) {}
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+    ~ArenaScope() { arena.rewind(start); }
+
+    MonotonicArena& arena;
+
+private:
+    MonotonicArena::Mark start;
+};
+
+/// Standard allocator drawing from a \ref MonotonicArena.
+template <typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+
+    explicit ArenaAllocator(MonotonicArena& arena = threadArena()) : arena(&arena) {}
+    explicit ArenaAllocator(ArenaScope& scope) : arena(&scope.arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(const size_t n) {
+        return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, const size_t n) {
+        arena->deallocate(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+
+    MonotonicArena* arena;
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
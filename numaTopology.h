@@ -0,0 +1,133 @@
+#pragma once
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/**
+ * @file numaTopology.h
+ *
+ * NUMA nodes of the machine and their CPUs, read from Linux sysfs
+ * (/sys/devices/system/node), pinning of threads to the CPUs of a node,
+ * and vectors left uninitialized on allocation so that their pages are
+ * first touched, hence placed, by the threads that fill them. Other
+ * systems are seen as a single node and threads are not pinned.
+ */
+
+/// @return the CPUs of a sysfs CPU list such as "0-3,8-11".
+inline std::vector<int> parseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty() || item == "\n") continue;
+        const auto dash = item.find('-');
+        const int first = std::atoi(item.substr(0, dash).c_str());
+        const int last = dash == std::string::npos ? first : std::atoi(item.substr(dash + 1).c_str());
+        for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+struct NumaTopology {
+    std::vector<std::vector<int>> nodeCpus; ///< CPUs of each node
+
+    size_t nbNodes() const { return nodeCpus.size(); }
+
+    /// @return the node of \a cpu (0 if unknown).
+    size_t nodeOfCpu(const int cpu) const {
+        for (size_t node = 0; node < nodeCpus.size(); ++node) {
+            for (const auto c : nodeCpus[node]) {
+                if (c == cpu) return node;
+            }
+        }
+        return 0;
+    }
+
+    /// @return the node the calling thread runs on (0 if unknown).
+    size_t currentNode() const {
+#if defined(__linux__)
+        if (nbNodes() > 1) return nodeOfCpu(sched_getcpu());
+#endif
+        return 0;
+    }
+
+    /// @return a topology made of a single node.
+    static NumaTopology singleNode() {
+        NumaTopology topology;
+        topology.nodeCpus.emplace_back();
+        return topology;
+    }
+
+    /// @return the nodes with CPUs, or a single node when the topology is
+    /// unavailable.
+    static NumaTopology detect() {
+        NumaTopology topology;
+#if defined(__linux__)
+        std::ifstream online("/sys/devices/system/node/online");
+        std::string list;
+        if (online && std::getline(online, list)) {
+            for (const auto node : parseCpuList(list)) {
+                std::ifstream cpuList("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+                std::string cpus;
+                if (!cpuList || !std::getline(cpuList, cpus)) continue;
+                auto nodeCpus = parseCpuList(cpus);
+                if (!nodeCpus.empty()) topology.nodeCpus.push_back(std::move(nodeCpus));
+            }
+        }
+#endif
+        if (topology.nodeCpus.empty()) topology.nodeCpus.emplace_back();
+        return topology;
+    }
+};
+
+/// Restricts \a thread to \a cpus. @return false when pinning failed or is
+/// not supported.
+inline bool pinThread(std::thread& thread, const std::vector<int>& cpus) {
+#if defined(__linux__)
+    if (cpus.empty()) return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const auto cpu : cpus) {
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+/// Allocator default-initializing its elements, so that resizing a vector
+/// of scalars does not touch its pages.
+template <typename T>
+struct FirstTouchAllocator : std::allocator<T> {
+    template <typename U>
+    struct rebind {
+        typedef FirstTouchAllocator<U> other;
+    };
+
+    FirstTouchAllocator() = default;
+    template <typename U>
+    FirstTouchAllocator(const FirstTouchAllocator<U>&) {}
+
+    template <typename U>
+    void construct(U* p) {
+        ::new (static_cast<void*>(p)) U;
+    }
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args) {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+};
+
+template <typename T>
+using FirstTouchVector = std::vector<T, FirstTouchAllocator<T>>;
@@ -0,0 +1,163 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <istream>
+#include <vector>
+
+#include "threadPool.h"
+#include "volStream.h"
+
+/**
+ * @brief Binary volume stored as runs of foreground voxels along x, row
+ * by row, for large and mostly empty volumes (e.g. thin-walled parts):
+ * memory grows with the number of runs, i.e. with the boundary of the
+ * object, instead of its bounding box.
+ *
+ * The runs of the row (y, z) are sorted and disjoint; a voxel is found by
+ * a binary search in its row, and the surfels, the faces between a voxel
+ * and a background voxel, are extracted by merging the runs of adjacent
+ * rows, without expanding them into voxels.
+ */
+class RunLengthVolume {
+public:
+    /// Foreground voxels [x0, x1) of a row.
+    struct Run {
+        int32_t x0, x1;
+    };
+
+    /// Face of the voxel (x, y, z) orthogonal to \a axis, on its positive
+    /// side if \a positive; it faces a background voxel.
+    struct Surfel {
+        int32_t x, y, z;
+        uint8_t axis;
+        bool positive;
+    };
+
+    RunLengthVolume() = default;
+
+    /// Empty volume over the box [\a lower, \a upper] (inclusive).
+    RunLengthVolume(const std::array<int, 3>& lower, const std::array<int, 3>& upper)
+            : lower(lower), upper(upper), rowStart(nbRows() + 1, 0) {}
+
+    /// Reads the payload of a `.vol` stream positioned after its header,
+    /// keeping the voxels for which \a isForeground(value) holds. The
+    /// payload is streamed by blocks of planes whose rows are encoded in
+    /// parallel, so that the dense volume is never held in memory.
+    template <typename Predicate>
+    static bool fromVol(std::istream& in, const VolHeader& header, const Predicate& isForeground, ThreadPool& pool,
+                        RunLengthVolume& volume, const int planesPerBlock = 16) {
+        const auto nx = header.sizes[0], ny = header.sizes[1];
+        volume = RunLengthVolume({{0, 0, 0}}, {{nx - 1, ny - 1, header.sizes[2] - 1}});
+        std::vector<std::vector<Run>> blockRuns(static_cast<size_t>(ny) * planesPerBlock);
+        const bool complete = streamVolPlanes(in, header, 0, header.sizes[2], planesPerBlock, [&](const int z0, const int z1, const unsigned char* data) {
+            const size_t nbBlockRows = static_cast<size_t>(ny) * (z1 - z0);
+            pool.parallelFor(0, nbBlockRows, 64, [&](size_t begin, size_t end) {
+                for (auto r = begin; r < end; ++r) {
+                    const auto row = data + r * nx;
+                    auto& runs = blockRuns[r];
+                    runs.clear();
+                    for (int x = 0; x < nx; ++x) {
+                        if (!isForeground(row[x])) continue;
+                        const int x0 = x;
+                        while (x < nx && isForeground(row[x])) ++x;
+                        runs.push_back({x0, x});
+                    }
+                }
+            });
+            const size_t firstRow = static_cast<size_t>(ny) * z0;
+            for (size_t r = 0; r < nbBlockRows; ++r) {
+                volume.runs.insert(volume.runs.end(), blockRuns[r].begin(), blockRuns[r].end());
+                volume.rowStart[firstRow + r + 1] = static_cast<uint32_t>(volume.runs.size());
+            }
+        });
+        volume.runs.shrink_to_fit();
+        return complete;
+    }
+
+    size_t nbRows() const {
+        return static_cast<size_t>(upper[1] - lower[1] + 1) * (upper[2] - lower[2] + 1);
+    }
+
+    size_t nbRuns() const { return runs.size(); }
+
+    size_t nbVoxels() const {
+        size_t n = 0;
+        for (const auto& run : runs) n += run.x1 - run.x0;
+        return n;
+    }
+
+    /// @return the memory held by the runs, in bytes.
+    size_t memory() const {
+        return runs.capacity() * sizeof(Run) + rowStart.capacity() * sizeof(uint32_t);
+    }
+
+    const std::array<int, 3>& lowerBound() const { return lower; }
+    const std::array<int, 3>& upperBound() const { return upper; }
+
+    /// @return the runs [first, last) of the row (y, z), empty outside.
+    std::pair<const Run*, const Run*> row(const int y, const int z) const {
+        if (y < lower[1] || y > upper[1] || z < lower[2] || z > upper[2]) return {nullptr, nullptr};
+        const auto r = rowIndex(y, z);
+        return {runs.data() + rowStart[r], runs.data() + rowStart[r + 1]};
+    }
+
+    bool operator()(const int x, const int y, const int z) const {
+        const auto range = row(y, z);
+        const auto it = std::upper_bound(range.first, range.second, x, [](const int v, const Run& run) { return v < run.x1; });
+        return it != range.second && it->x0 <= x;
+    }
+
+    /// @return the surfels of the volume, row by row: for each row, its
+    /// x surfels, then its y and z surfels, in increasing order of x.
+    std::vector<Surfel> surfels(ThreadPool& pool) const {
+        const auto ny = upper[1] - lower[1] + 1;
+        std::vector<std::vector<Surfel>> rowSurfels(nbRows());
+        pool.parallelFor(0, nbRows(), 64, [&](size_t begin, size_t end) {
+            for (auto r = begin; r < end; ++r) {
+                const int y = lower[1] + static_cast<int>(r % ny), z = lower[2] + static_cast<int>(r / ny);
+                const auto range = row(y, z);
+                auto& out = rowSurfels[r];
+                for (auto run = range.first; run != range.second; ++run) {
+                    out.push_back({run->x0, y, z, 0, false});
+                    out.push_back({run->x1 - 1, y, z, 0, true});
+                }
+                const std::array<int, 4> dy = {{-1, 1, 0, 0}}, dz = {{0, 0, -1, 1}};
+                for (auto k = 0; k < 4; ++k) {
+                    const auto neighbor = this->row(y + dy[k], z + dz[k]);
+                    const uint8_t axis = dy[k] != 0 ? 1 : 2;
+                    const bool positive = dy[k] + dz[k] > 0;
+                    // Voxels of the row not covered by the neighbor row.
+                    auto other = neighbor.first;
+                    for (auto run = range.first; run != range.second; ++run) {
+                        int x = run->x0;
+                        while (x < run->x1) {
+                            while (other != neighbor.second && other->x1 <= x) ++other;
+                            const int covered = other != neighbor.second ? std::max(x, other->x0) : run->x1;
+                            const int stop = std::min(run->x1, covered);
+                            for (; x < stop; ++x) out.push_back({x, y, z, axis, positive});
+                            if (x < run->x1) x = std::min(run->x1, other->x1);
+                        }
+                    }
+                }
+            }
+        });
+        std::vector<size_t> offsets(nbRows() + 1, 0);
+        for (size_t r = 0; r < nbRows(); ++r) offsets[r + 1] = offsets[r] + rowSurfels[r].size();
+        std::vector<Surfel> result(offsets.back());
+        pool.parallelFor(0, nbRows(), 256, [&](size_t begin, size_t end) {
+            for (auto r = begin; r < end; ++r) std::copy(rowSurfels[r].begin(), rowSurfels[r].end(), result.begin() + offsets[r]);
+        });
+        return result;
+    }
+
+private:
+    size_t rowIndex(const int y, const int z) const {
+        return static_cast<size_t>(z - lower[2]) * (upper[1] - lower[1] + 1) + (y - lower[1]);
+    }
+
+    std::array<int, 3> lower = {{0, 0, 0}};
+    std::array<int, 3> upper = {{-1, -1, -1}};
+    std::vector<Run> runs;
+    std::vector<uint32_t> rowStart; ///< runs of row r: [rowStart[r], rowStart[r + 1])
+};
@@ -0,0 +1,165 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "threadPool.h"
+
+/**
+ * @brief Dependency graph of tasks run on a \ref ThreadPool. A task starts
+ * as soon as all the tasks it depends on are done, so that independent
+ * chains overlap and the wall time approaches the longest chain rather
+ * than the sum of the tasks. Tasks added with \ref addOnMainThread (e.g.
+ * viewer calls) are run by the thread calling \ref run.
+ *
+ * If a task throws, the tasks depending on it are skipped and \ref run
+ * rethrows the first exception once the other tasks are done.
+ */
+class TaskGraph {
+public:
+    typedef size_t TaskId;
+
+    /// Adds a task run on the pool after \a dependencies, which must
+    /// have been added before.
+    TaskId add(std::string name, std::function<void()> work, const std::vector<TaskId>& dependencies = {}) {
+        return addTask(std::move(name), std::move(work), dependencies, false);
+    }
+
+    /// Adds a task run on the thread calling \ref run after \a dependencies.
+    TaskId addOnMainThread(std::string name, std::function<void()> work, const std::vector<TaskId>& dependencies = {}) {
+        return addTask(std::move(name), std::move(work), dependencies, true);
+    }
+
+    /// Runs all the tasks and returns when they are done.
+    void run(ThreadPool& pool) {
+        const auto start = std::chrono::steady_clock::now();
+        auto state = std::make_shared<RunState>();
+        state->remaining.resize(tasks.size());
+        state->skipped.assign(tasks.size(), 0);
+        std::vector<TaskId> roots;
+        for (TaskId id = 0; id < tasks.size(); ++id) {
+            state->remaining[id] = tasks[id].dependencies.size();
+            if (state->remaining[id] == 0) roots.push_back(id);
+        }
+        // The roots are collected first: once scheduled, they release
+        // their successors concurrently.
+        for (const auto id : roots) schedule(pool, state, id);
+        std::unique_lock<std::mutex> lock(state->mutex);
+        while (state->nbDone < tasks.size()) {
+            state->cv.wait(lock, [&] { return state->nbDone == tasks.size() || !state->mainReady.empty(); });
+            if (state->mainReady.empty()) continue;
+            const auto id = state->mainReady.front();
+            state->mainReady.pop_front();
+            lock.unlock();
+            execute(pool, state, id);
+            lock.lock();
+        }
+        wallTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (state->error) std::rethrow_exception(state->error);
+    }
+
+    /// @return the wall time (ms) of the last \ref run.
+    double wall() const { return wallTime; }
+
+    /// @return the sum of the durations (ms) of the tasks of the last run.
+    double total() const {
+        double sum = 0.;
+        for (const auto& task : tasks) sum += task.duration;
+        return sum;
+    }
+
+    /// @return the duration (ms) of the longest chain of the last run.
+    double longestChain() const {
+        // Tasks are added after their dependencies: ids are a topological order.
+        std::vector<double> finish(tasks.size(), 0.);
+        double longest = 0.;
+        for (TaskId id = 0; id < tasks.size(); ++id) {
+            for (const auto d : tasks[id].dependencies) finish[id] = std::max(finish[id], finish[d]);
+            finish[id] += tasks[id].duration;
+            longest = std::max(longest, finish[id]);
+        }
+        return longest;
+    }
+
+    size_t size() const { return tasks.size(); }
+    const std::string& name(const TaskId id) const { return tasks[id].name; }
+    double duration(const TaskId id) const { return tasks[id].duration; }
+
+private:
+    struct Task {
+        std::string name;
+        std::function<void()> work;
+        std::vector<TaskId> dependencies;
+        std::vector<TaskId> successors;
+        bool onMainThread;
+        double duration = 0.; ///< in ms
+    };
+
+    /// Progress of a \ref run, shared with the tasks in flight.
+    struct RunState {
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t nbDone = 0;
+        std::deque<TaskId> mainReady;
+        std::exception_ptr error;
+        std::vector<size_t> remaining; ///< dependencies not done yet
+        std::vector<char> skipped;     ///< a dependency failed
+    };
+
+    void schedule(ThreadPool& pool, const std::shared_ptr<RunState>& state, const TaskId id) {
+        if (tasks[id].onMainThread) {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->mainReady.push_back(id);
+            state->cv.notify_all();
+        } else {
+            pool.submit([this, &pool, state, id] { execute(pool, state, id); });
+        }
+    }
+
+    void execute(ThreadPool& pool, const std::shared_ptr<RunState>& state, const TaskId id) {
+        auto& task = tasks[id];
+        const auto t0 = std::chrono::steady_clock::now();
+        bool failed = state->skipped[id] != 0;
+        if (!failed) {
+            try {
+                task.work();
+            } catch (...) {
+                failed = true;
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if (!state->error) state->error = std::current_exception();
+            }
+        }
+        task.duration = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        std::vector<TaskId> ready;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            for (const auto next : task.successors) {
+                if (failed) state->skipped[next] = 1;
+                if (--state->remaining[next] == 0) ready.push_back(next);
+            }
+        }
+        // Successors are scheduled before this task counts as done, so
+        // that nothing is scheduled once run returns.
+        for (const auto next : ready) schedule(pool, state, next);
+        std::lock_guard<std::mutex> lock(state->mutex);
+        ++state->nbDone;
+        state->cv.notify_all();
+    }
+
+    TaskId addTask(std::string name, std::function<void()> work, const std::vector<TaskId>& dependencies, const bool onMainThread) {
+        const TaskId id = tasks.size();
+        tasks.push_back({std::move(name), std::move(work), dependencies, {}, onMainThread});
+        for (const auto d : dependencies) tasks[d].successors.push_back(id);
+        return id;
+    }
+
+    std::vector<Task> tasks;
+    double wallTime = 0.;
+};
@@ -0,0 +1,355 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "numaTopology.h"
+
+/**
+ * @brief A fixed-size work-stealing pool of worker threads, shared by the
+ * pipeline stages.
+ *
+ * Each worker owns a deque of tasks: tasks submitted from a worker go to
+ * the back of its deque and are run last-in first-out, tasks submitted
+ * from other threads go to a shared queue, and an idle worker steals the
+ * oldest task of another worker. Tasks are submitted with \ref submit and
+ * their result is retrieved through the returned future.
+ *
+ * \ref parallelFor splits an index range into chunks dealt in contiguous
+ * ranges to the participating threads, which keeps the elements a thread
+ * processes spatially close; a thread running out of chunks steals the
+ * upper half of the remaining range of another one, which balances the
+ * load when chunk costs vary (e.g. neighbor counts of dense creases vs
+ * flat regions).
+ *
+ * A NUMA-aware pool pins its workers to the CPUs of the nodes (workers
+ * are spread evenly over the nodes), and \ref parallelFor deals the
+ * index range in one contiguous part per node, processed first by the
+ * threads of that node; a thread keeps the chunks it steals in a range
+ * of its own, which other threads may steal from in turn. Loops over the
+ * same range hence touch the same part from the same node, so that data
+ * first touched in a loop stays local to the threads reading it in the
+ * next ones; \ref localChunkFraction tells how often it did.
+ */
+class ThreadPool {
+public:
+    /// Starts \a nbWorkers threads (hardware concurrency when 0), pinned
+    /// to the NUMA nodes when \a numaAware and the machine has several.
+    explicit ThreadPool(unsigned int nbWorkers = 0, const bool numaAware = false) {
+        if (nbWorkers == 0) nbWorkers = std::max(1u, std::thread::hardware_concurrency());
+        topology = numaAware ? NumaTopology::detect() : NumaTopology::singleNode();
+        for (unsigned int i = 0; i < nbWorkers; ++i) {
+            queues.emplace_back(new WorkQueue());
+            workerNodes.push_back(i * topology.nbNodes() / nbWorkers);
+        }
+        for (unsigned int i = 0; i < nbWorkers; ++i) {
+            workers.emplace_back([this, i] { workerLoop(i); });
+            if (topology.nbNodes() > 1) pinThread(workers.back(), topology.nodeCpus[workerNodes[i]]);
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& w : workers) w.join();
+    }
+
+    /// @return the number of worker threads.
+    size_t size() const {
+        return workers.size();
+    }
+
+    /// @return the number of NUMA nodes the loops are partitioned over.
+    size_t nbNodes() const {
+        return topology.nbNodes();
+    }
+
+    /// @return the fraction of the chunks of the parallel loops run so
+    /// far that were processed on the node they were dealt to (1 when the
+    /// loops are not partitioned over nodes).
+    double localChunkFraction() const {
+        const size_t total = loopChunks;
+        return total > 0 ? static_cast<double>(localChunks) / total : 1.;
+    }
+
+    /// Enqueues \a f and returns a future on its result.
+    template <typename F>
+    auto submit(F&& f) -> std::future<decltype(f())> {
+        typedef decltype(f()) Result;
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(f));
+        auto future = task->get_future();
+        push([task] { (*task)(); });
+        return future;
+    }
+
+    /// Calls `f(i, j)` on consecutive chunks `[i,j)` of `[begin,end)` of at
+    /// most \a grain indices (when \a grain is 0, about 8 chunks per
+    /// thread), and returns when all of them are processed. The calling
+    /// thread processes chunks too, so that this can be called from
+    /// within a task of the pool without deadlocking.
+    template <typename F>
+    void parallelFor(size_t begin, size_t end, size_t grain, const F& f) {
+        if (end <= begin) return;
+        if (grain == 0) grain = (end - begin + 8 * (size() + 1) - 1) / (8 * (size() + 1));
+        const size_t nbChunks = (end - begin + grain - 1) / grain;
+        const size_t nbParticipants = std::min(size() + 1, nbChunks);
+        // One range per participant, or one per node followed by one per
+        // participant: participants then start with the range of the node
+        // they run on, and keep what they steal in their own range.
+        const bool perNode = nbNodes() > 1;
+        const size_t nbHomes = perNode ? std::min(nbNodes(), nbChunks) : nbParticipants;
+        auto state = std::make_shared<LoopState>(nbHomes, perNode ? nbParticipants : 0, nbChunks);
+        // Helpers starting after all the chunks were taken return without
+        // touching f, which may not exist anymore at that time.
+        auto run = [this, state, perNode, begin, end, grain, &f] {
+            const size_t participant = state->nextParticipant++;
+            const size_t home = perNode ? currentNode() % state->nbHomes : participant;
+            const size_t own = perNode ? state->nbHomes + participant : participant;
+            size_t processed = 0, local = 0;
+            size_t c;
+            while (state->take(home, own, c)) {
+                f(begin + c * grain, std::min(end, begin + (c + 1) * grain));
+                ++processed;
+                if (perNode && state->homeOf(c) == home) ++local;
+            }
+            if (perNode) {
+                localChunks += local;
+                loopChunks += processed;
+            }
+            if (processed > 0) {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->done += processed;
+                if (state->done == state->nbChunks) state->cv.notify_all();
+            }
+        };
+        for (size_t i = 1; i < nbParticipants; ++i) push(run);
+        run();
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->cv.wait(lock, [&] { return state->done == state->nbChunks; });
+    }
+
+private:
+    typedef std::function<void()> Task;
+
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    /// Chunks [lo, hi) left to a participant of a parallelFor, padded
+    /// against false sharing.
+    struct ChunkRange {
+        std::mutex mutex;
+        size_t lo = 0;
+        size_t hi = 0;
+        char padding[64];
+    };
+
+    /// Chunks of a parallelFor: the first \a nbHomes ranges deal the
+    /// chunks (one per participant, or per node), the next ones receive
+    /// the chunks their participant steals. A range is only refilled by
+    /// its participant, once it is empty, and other threads only shrink
+    /// it, so that no stolen chunk is ever overwritten.
+    struct LoopState {
+        LoopState(const size_t nbHomes, const size_t nbStealRanges, const size_t nbChunks)
+                : ranges(nbHomes + nbStealRanges), nbHomes(nbHomes), nbChunks(nbChunks) {
+            for (size_t p = 0; p < nbHomes; ++p) {
+                ranges[p].lo = nbChunks * p / nbHomes;
+                ranges[p].hi = nbChunks * (p + 1) / nbHomes;
+            }
+        }
+
+        /// @return the home range \a chunk was dealt to.
+        size_t homeOf(const size_t chunk) const {
+            return ((chunk + 1) * nbHomes + nbChunks - 1) / nbChunks - 1;
+        }
+
+        /// Takes the next chunk of the range \a own, else of the range \a
+        /// home, else steals the upper half of another range into \a own.
+        bool take(const size_t home, const size_t own, size_t& chunk) {
+            if (own >= ranges.size()) return false;
+            if (takeFrom(ranges[own], chunk) || (home != own && takeFrom(ranges[home], chunk))) return true;
+            for (size_t k = 1; k < ranges.size(); ++k) {
+                const auto v = (home + k) % ranges.size();
+                if (v == own) continue;
+                auto& victim = ranges[v];
+                size_t lo, hi;
+                {
+                    std::lock_guard<std::mutex> lock(victim.mutex);
+                    if (victim.lo >= victim.hi) continue;
+                    hi = victim.hi;
+                    lo = victim.hi - (victim.hi - victim.lo + 1) / 2;
+                    victim.hi = lo;
+                }
+                chunk = lo;
+                std::lock_guard<std::mutex> lock(ranges[own].mutex);
+                ranges[own].lo = lo + 1;
+                ranges[own].hi = hi;
+                return true;
+            }
+            return false;
+        }
+
+        static bool takeFrom(ChunkRange& range, size_t& chunk) {
+            std::lock_guard<std::mutex> lock(range.mutex);
+            if (range.lo >= range.hi) return false;
+            chunk = range.lo++;
+            return true;
+        }
+
+        std::vector<ChunkRange> ranges;
+        const size_t nbHomes;
+        std::atomic<size_t> nextParticipant{0};
+        const size_t nbChunks;
+        size_t done = 0;
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+
+    /// The pool and index of the worker running on this thread, if any.
+    struct WorkerIdentity {
+        const ThreadPool* pool = nullptr;
+        size_t index = 0;
+    };
+
+    static WorkerIdentity& currentWorker() {
+        static thread_local WorkerIdentity identity;
+        return identity;
+    }
+
+    /// @return the node of the calling thread: the node a worker is pinned
+    /// to, or the node another thread currently runs on.
+    size_t currentNode() const {
+        const auto& worker = currentWorker();
+        return worker.pool == this ? workerNodes[worker.index] : topology.currentNode();
+    }
+
+    void push(Task task) {
+        // Counted before being visible, so that a thief never decrements
+        // the count of a task it was not incremented for.
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++pending;
+        }
+        const auto& worker = currentWorker();
+        auto& queue = worker.pool == this ? *queues[worker.index] : injected;
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        cv.notify_one();
+    }
+
+    /// Pops the newest task of the worker \a self, else the oldest
+    /// injected task, else steals the oldest task of another worker.
+    bool pop(const size_t self, Task& task) {
+        {
+            auto& own = *queues[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                --pending;
+                return true;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(injected.mutex);
+            if (!injected.tasks.empty()) {
+                task = std::move(injected.tasks.front());
+                injected.tasks.pop_front();
+                --pending;
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues.size(); ++k) {
+            auto& victim = *queues[(self + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                --pending;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(const size_t self) {
+        currentWorker() = {this, self};
+        for (;;) {
+            Task task;
+            if (pop(self, task)) {
+                task();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return stopping || pending > 0; });
+            if (stopping && pending == 0) return;
+        }
+    }
+
+    NumaTopology topology; ///< a single node unless NUMA-aware
+    std::vector<size_t> workerNodes;
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    WorkQueue injected;
+    std::atomic<size_t> pending{0};
+    std::atomic<size_t> localChunks{0}; ///< chunks of per-node loops processed on their node
+    std::atomic<size_t> loopChunks{0};  ///< chunks of per-node loops
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+};
+
+/// The pool shared by the pipeline stages, with the arguments it was
+/// created with.
+struct SharedThreadPool {
+    SharedThreadPool(const unsigned int nbWorkers, const bool numaAware)
+            : nbWorkers(nbWorkers), numaAware(numaAware), pool(nbWorkers, numaAware) {}
+
+    const unsigned int nbWorkers;
+    const bool numaAware;
+    ThreadPool pool;
+};
+
+inline SharedThreadPool& sharedThreadPoolInstance(const unsigned int nbWorkers, const bool numaAware) {
+    static SharedThreadPool shared(nbWorkers, numaAware);
+    return shared;
+}
+
+/// @return the pool shared by the pipeline stages. Unless it was created
+/// by the overload below, it is created on the first call with all cores
+/// and without NUMA placement.
+inline ThreadPool& sharedThreadPool() {
+    return sharedThreadPoolInstance(0, false).pool;
+}
+
+/// @return the pool shared by the pipeline stages, created on the first
+/// call with \a nbWorkers threads (all cores when 0), NUMA-aware or not.
+/// A pool exists once only: a warning is printed when it was already
+/// created with other arguments, e.g. used before the command line was
+/// read.
+inline ThreadPool& sharedThreadPool(const unsigned int nbWorkers, const bool numaAware) {
+    auto& shared = sharedThreadPoolInstance(nbWorkers, numaAware);
+    if (shared.nbWorkers != nbWorkers || shared.numaAware != numaAware) {
+        std::cerr << "Warning: the shared thread pool already exists with " << shared.pool.size() << " workers"
+                  << (shared.numaAware ? ", NUMA-aware" : "") << "; the request for " << nbWorkers
+                  << " workers (0: all cores)" << (numaAware ? ", NUMA-aware," : "") << " is ignored" << std::endl;
+    }
+    return shared.pool;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/// Disjoint sets of the indices [0,n), with path halving and union by size.
+class UnionFind {
+public:
+    explicit UnionFind(const size_t n) : parent(n), sizes(n, 1) {
+        for (size_t i = 0; i < n; ++i) parent[i] = i;
+    }
+
+    size_t find(size_t i) {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    }
+
+    /// Merges the sets of \a a and \a b. @return the root of the merged
+    /// set, and the root that was absorbed (equal to the former if they
+    /// were already merged).
+    std::pair<size_t, size_t> unite(size_t a, size_t b) {
+        a = find(a);
+        b = find(b);
+        if (a == b) return {a, a};
+        if (sizes[a] < sizes[b]) std::swap(a, b);
+        parent[b] = a;
+        sizes[a] += sizes[b];
+        return {a, b};
+    }
+
+    size_t size(const size_t i) { return sizes[find(i)]; }
+
+private:
+    std::vector<size_t> parent;
+    std::vector<size_t> sizes;
+};
@@ -0,0 +1,365 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "kernelTable.h"
+#include "octahedralNormals.h"
+
+/**
+ * @file varifoldBatch.h
+ *
+ * Batched inner loop of the varifold curvature computation. For a given
+ * center, neighbors are gathered by groups of \ref VarifoldBatch::kLanes
+ * into local structure-of-arrays buffers, and distances, kernel weights
+ * and derivatives, projections and the numerator/denominator sums are
+ * computed lane by lane, then reduced. Lane loops are branch-free so that
+ * the compiler vectorizes them, given -fno-math-errno and
+ * -fno-trapping-math (set by CMakeLists.txt): check with -fopt-info-vec.
+ * The exponential profile stays scalar (std::exp has no vector version),
+ * its tabulated counterpart vectorizes.
+ *
+ * With GCC on x86-64, each kernel is compiled for AVX-512, AVX2 and the
+ * baseline instruction set, and the best version is selected at load
+ * time (target_clones); other compilers get the scalar version.
+ */
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define VARIFOLD_TARGET_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#define VARIFOLD_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define VARIFOLD_TARGET_CLONES
+#define VARIFOLD_ALWAYS_INLINE inline
+#endif
+
+namespace VarifoldBatch {
+
+constexpr int kLanes = 8;
+
+/// Guards the divisions of masked lanes.
+constexpr double kTiny = 1e-12;
+
+// Kernel profiles: weight rho(r) and derivative rho'(r) for r = d/R in
+// [0,1], evaluated in the lane precision T. make(a) builds the profile
+// from the parameter of the exponential kernels.
+
+struct LinearProfile {
+    static LinearProfile make(const double) { return {}; }
+    template <typename T>
+    void operator()(const T r, T& w, T& dw) const {
+        w = 1 - r;
+        dw = -1;
+    }
+};
+
+struct PolynomialProfile {
+    static PolynomialProfile make(const double) { return {}; }
+    template <typename T>
+    void operator()(const T r, T& w, T& dw) const {
+        w = (1 - r * r) / static_cast<T>(M_PI * 2);
+        dw = -r / static_cast<T>(M_PI);
+    }
+};
+
+struct ExponentialProfile {
+    double a;
+    static ExponentialProfile make(const double a) { return {a}; }
+    template <typename T>
+    void operator()(const T r, T& w, T& dw) const {
+        const T d = std::max<T>(1 - r * r, static_cast<T>(kTiny));
+        w = std::exp(static_cast<T>(-a) / d);
+        dw = static_cast<T>(-2 * a) * r * w / (d * d);
+    }
+};
+
+struct TabulatedProfile {
+    const ExponentialKernelTable* table;
+    static TabulatedProfile make(const double a) { return {&ExponentialKernelTable::get(a)}; }
+    template <typename T>
+    void operator()(const T r, T& w, T& dw) const {
+        w = static_cast<T>(table->value(r * r));
+        dw = static_cast<T>(table->derivative(r * r, r));
+    }
+};
+
+/// How the tangent plane of an element is given by its projection data.
+enum class Projection {
+    Normal,      ///< q[0..2] is a normal vector, not necessarily unit
+    AxisWeights, ///< p[0..2] are the float weights p of the projector I - diag(p)
+    Projector,   ///< q[0..5] are the xx,xy,xz,yy,yz,zz components of I - nn^T
+    Octahedral32, ///< oct32 holds 32-bit octahedral codes of the normals
+    Octahedral48  ///< oct48 holds 48-bit octahedral codes of the normals (6 bytes each)
+};
+
+/// Structure-of-arrays view on the elements: positions (x,y,z) and
+/// projection data (q, p or encoded normals) depending on the \ref Projection.
+struct Elements {
+    const double* x;
+    const double* y;
+    const double* z;
+    const double* q[6];
+    const float* p[3];
+    const uint32_t* oct32;
+    const uint8_t* oct48;
+};
+
+/// Gathers the projection data of the element \a j into the lane \a l:
+/// components in \a q, codes of encoded normals in \a codes or \a
+/// codes48 (decoded by \ref decodeProjections).
+template <Projection P, typename Scalar>
+VARIFOLD_ALWAYS_INLINE void gatherProjection(const Elements& e, const size_t j, const int l, Scalar q[6][kLanes],
+                                             uint32_t codes[kLanes], const uint8_t* codes48[kLanes]) {
+    constexpr int nbQ = P == Projection::Projector ? 6 : P == Projection::Normal ? 3 : 0;
+    for (int k = 0; k < nbQ; ++k) q[k][l] = static_cast<Scalar>(e.q[k][j]);
+    if (P == Projection::AxisWeights) {
+        for (int k = 0; k < 3; ++k) q[k][l] = static_cast<Scalar>(e.p[k][j]);
+    }
+    if (P == Projection::Octahedral32) codes[l] = e.oct32[j];
+    if (P == Projection::Octahedral48) codes48[l] = e.oct48 + 6 * j;
+}
+
+/// Decodes the normals of the lanes into q[0..2], for encoded projections.
+template <Projection P, typename Scalar>
+VARIFOLD_ALWAYS_INLINE void decodeProjections(Scalar q[6][kLanes], const uint32_t codes[kLanes],
+                                              const uint8_t* const codes48[kLanes]) {
+    if (P != Projection::Octahedral32 && P != Projection::Octahedral48) return;
+    for (int l = 0; l < kLanes; ++l) {
+        double n[3];
+        if (P == Projection::Octahedral32) {
+            OctahedralNormals::decode32(codes[l], n[0], n[1], n[2]);
+        } else {
+            OctahedralNormals::decode48(codes48[l], n[0], n[1], n[2]);
+        }
+        for (int k = 0; k < 3; ++k) q[k][l] = static_cast<Scalar>(n[k]);
+    }
+}
+
+/// Projects (dx,dy,dz) onto the tangent plane of the lane \a l of \a q.
+template <Projection P, typename Scalar>
+VARIFOLD_ALWAYS_INLINE void projectLane(const Scalar q[6][kLanes], const int l, const Scalar dx, const Scalar dy,
+                                        const Scalar dz, Scalar& px, Scalar& py, Scalar& pz) {
+    if (P == Projection::Projector) {
+        // Multiply-adds only.
+        px = q[0][l] * dx + q[1][l] * dy + q[2][l] * dz;
+        py = q[1][l] * dx + q[3][l] * dy + q[4][l] * dz;
+        pz = q[2][l] * dx + q[4][l] * dy + q[5][l] * dz;
+    } else if (P == Projection::Octahedral32 || P == Projection::Octahedral48) {
+        // Decoded normals are unit vectors.
+        const Scalar t = dx * q[0][l] + dy * q[1][l] + dz * q[2][l];
+        px = dx - t * q[0][l];
+        py = dy - t * q[1][l];
+        pz = dz - t * q[2][l];
+    } else if (P == Projection::AxisWeights) {
+        px = dx * (1 - q[0][l]);
+        py = dy * (1 - q[1][l]);
+        pz = dz * (1 - q[2][l]);
+    } else {
+        const Scalar t = (dx * q[0][l] + dy * q[1][l] + dz * q[2][l])
+                         / (q[0][l] * q[0][l] + q[1][l] * q[1][l] + q[2][l] * q[2][l]);
+        px = dx - t * q[0][l];
+        py = dy - t * q[1][l];
+        pz = dz - t * q[2][l];
+    }
+}
+
+/**
+ * Accumulates, for the element \a center, the sums over its \a
+ * nbNeighbors neighbors j of rho'(d/R) Pi_j(xj - xc)/d (in \a top) and
+ * rho(d/R) (in \a bottom), for the neighbors at distance d < R.
+ *
+ * Lanes compute in \a Scalar: offsets xj - xc are taken in double
+ * precision and then rounded, so that float lanes (twice as many per
+ * vector register) only lose precision relative to the radius. Sums are
+ * reduced in double precision.
+ */
+template <typename Profile, Projection P, typename Scalar = double>
+VARIFOLD_ALWAYS_INLINE void accumulate(const Elements& e, const size_t center, const size_t* neighbors,
+                                       const size_t nbNeighbors, const double radius, const Profile& profile,
+                                       double top[3], double& bottom) {
+    Scalar dx[kLanes], dy[kLanes], dz[kLanes], q[6][kLanes], valid[kLanes], other[kLanes];
+    uint32_t codes[kLanes];
+    const uint8_t* codes48[kLanes];
+    double sx = 0., sy = 0., sz = 0., sb = 0.;
+    const Scalar sRadius = static_cast<Scalar>(radius);
+    const Scalar invRadius = static_cast<Scalar>(1.0 / radius);
+    const Scalar tiny = static_cast<Scalar>(kTiny);
+    for (size_t first = 0; first < nbNeighbors; first += kLanes) {
+        const int count = static_cast<int>(std::min<size_t>(kLanes, nbNeighbors - first));
+        // Gather. Padding lanes repeat the last neighbor and are masked
+        // out, so that the loop has no branch.
+        for (int l = 0; l < kLanes; ++l) {
+            const auto j = neighbors[first + std::min(l, count - 1)];
+            dx[l] = static_cast<Scalar>(e.x[j] - e.x[center]);
+            dy[l] = static_cast<Scalar>(e.y[j] - e.y[center]);
+            dz[l] = static_cast<Scalar>(e.z[j] - e.z[center]);
+            gatherProjection<P>(e, j, l, q, codes, codes48);
+            valid[l] = l < count ? 1 : 0;
+            other[l] = j != center ? valid[l] : 0;
+        }
+        decodeProjections<P>(q, codes, codes48);
+        // Compute in lanes.
+        Scalar lx[kLanes], ly[kLanes], lz[kLanes], lb[kLanes];
+        for (int l = 0; l < kLanes; ++l) {
+            const Scalar d = std::sqrt(dx[l] * dx[l] + dy[l] * dy[l] + dz[l] * dz[l]);
+            const Scalar inside = valid[l] * (d < sRadius ? 1 : 0);
+            Scalar w, dw;
+            profile(std::min<Scalar>(d * invRadius, 1), w, dw);
+            Scalar px, py, pz;
+            projectLane<P>(q, l, dx[l], dy[l], dz[l], px, py, pz);
+            const Scalar c = inside * other[l] * dw / std::max(d, tiny);
+            lx[l] = c * px;
+            ly[l] = c * py;
+            lz[l] = c * pz;
+            lb[l] = inside * w;
+        }
+        // Reduce.
+        for (int l = 0; l < kLanes; ++l) {
+            sx += lx[l];
+            sy += ly[l];
+            sz += lz[l];
+            sb += lb[l];
+        }
+    }
+    top[0] = sx;
+    top[1] = sy;
+    top[2] = sz;
+    bottom = sb;
+}
+
+/**
+ * Half-pair counterpart of \ref accumulate: the \a nbNeighbors elements
+ * j of the half neighborhood of \a center are at the given \a distances
+ * d < R, and each pair {center, j} is evaluated once for both endpoints.
+ * It adds rho'(d/R) Pi_j(xj - xc)/d and rho(d/R) to the sums of the
+ * center, and rho'(d/R) Pi_c(xc - xj)/d and rho(d/R) to those of j, in
+ * \a top (3 per element) and \a bottom (1 per element).
+ */
+template <typename Profile, Projection P, typename Scalar = double>
+VARIFOLD_ALWAYS_INLINE void accumulatePairs(const Elements& e, const size_t center, const uint32_t* neighbors,
+                                            const Scalar* distances, const size_t nbNeighbors, const double radius,
+                                            const Profile& profile, double* top, double* bottom) {
+    Scalar dx[kLanes], dy[kLanes], dz[kLanes], d[kLanes], qj[6][kLanes], qc[6][kLanes], valid[kLanes];
+    uint32_t codes[kLanes];
+    const uint8_t* codes48[kLanes];
+    double sx = 0., sy = 0., sz = 0., sb = 0.;
+    const Scalar invRadius = static_cast<Scalar>(1.0 / radius);
+    const Scalar tiny = static_cast<Scalar>(kTiny);
+    for (int l = 0; l < kLanes; ++l) gatherProjection<P>(e, center, l, qc, codes, codes48);
+    decodeProjections<P>(qc, codes, codes48);
+    for (size_t first = 0; first < nbNeighbors; first += kLanes) {
+        const int count = static_cast<int>(std::min<size_t>(kLanes, nbNeighbors - first));
+        for (int l = 0; l < kLanes; ++l) {
+            const auto k = first + std::min(l, count - 1);
+            const size_t j = neighbors[k];
+            dx[l] = static_cast<Scalar>(e.x[j] - e.x[center]);
+            dy[l] = static_cast<Scalar>(e.y[j] - e.y[center]);
+            dz[l] = static_cast<Scalar>(e.z[j] - e.z[center]);
+            d[l] = distances[k];
+            gatherProjection<P>(e, j, l, qj, codes, codes48);
+            valid[l] = l < count ? 1 : 0;
+        }
+        decodeProjections<P>(qj, codes, codes48);
+        Scalar lx[kLanes], ly[kLanes], lz[kLanes], lb[kLanes], ox[kLanes], oy[kLanes], oz[kLanes];
+        for (int l = 0; l < kLanes; ++l) {
+            Scalar w, dw;
+            profile(std::min<Scalar>(d[l] * invRadius, 1), w, dw);
+            const Scalar c = valid[l] * dw / std::max(d[l], tiny);
+            Scalar px, py, pz;
+            projectLane<P>(qj, l, dx[l], dy[l], dz[l], px, py, pz);
+            lx[l] = c * px;
+            ly[l] = c * py;
+            lz[l] = c * pz;
+            lb[l] = valid[l] * w;
+            // From j, the center is at -(dx,dy,dz).
+            projectLane<P>(qc, l, dx[l], dy[l], dz[l], px, py, pz);
+            ox[l] = -c * px;
+            oy[l] = -c * py;
+            oz[l] = -c * pz;
+        }
+        for (int l = 0; l < kLanes; ++l) {
+            sx += lx[l];
+            sy += ly[l];
+            sz += lz[l];
+            sb += lb[l];
+        }
+        for (int l = 0; l < count; ++l) {
+            const size_t j = neighbors[first + l];
+            top[3 * j] += ox[l];
+            top[3 * j + 1] += oy[l];
+            top[3 * j + 2] += oz[l];
+            bottom[j] += lb[l];
+        }
+    }
+    top[3 * center] += sx;
+    top[3 * center + 1] += sy;
+    top[3 * center + 2] += sz;
+    bottom[center] += sb;
+}
+
+/// Compiled kernel of a (profile, projection, lane precision)
+/// combination: Kernel<Profile, P, Scalar>::run has the signature of
+/// \ref accumulate, Kernel<Profile, P, Scalar>::runPairs that of \ref
+/// accumulatePairs, and they call their multiversioned instantiations.
+template <typename Profile, Projection P, typename Scalar>
+struct Kernel;
+
+#define VARIFOLD_BATCH_KERNEL(NAME, PROFILE, PROJECTION, SCALAR)                                      \
+    VARIFOLD_TARGET_CLONES static void NAME(const Elements& e, const size_t center,                   \
+                                            const size_t* neighbors, const size_t nbNeighbors,         \
+                                            const double radius, const PROFILE& profile,               \
+                                            double top[3], double& bottom) {                           \
+        accumulate<PROFILE, PROJECTION, SCALAR>(e, center, neighbors, nbNeighbors, radius, profile, top, bottom); \
+    }                                                                                                  \
+    VARIFOLD_TARGET_CLONES static void NAME##Pairs(const Elements& e, const size_t center,            \
+                                                   const uint32_t* neighbors, const SCALAR* distances, \
+                                                   const size_t nbNeighbors, const double radius,      \
+                                                   const PROFILE& profile, double* top, double* bottom) { \
+        accumulatePairs<PROFILE, PROJECTION, SCALAR>(e, center, neighbors, distances, nbNeighbors, radius, \
+                                                     profile, top, bottom);                            \
+    }                                                                                                  \
+    template <>                                                                                        \
+    struct Kernel<PROFILE, PROJECTION, SCALAR> {                                                       \
+        static void run(const Elements& e, const size_t center, const size_t* neighbors,              \
+                        const size_t nbNeighbors, const double radius, const PROFILE& profile,        \
+                        double top[3], double& bottom) {                                               \
+            NAME(e, center, neighbors, nbNeighbors, radius, profile, top, bottom);                     \
+        }                                                                                              \
+        static void runPairs(const Elements& e, const size_t center, const uint32_t* neighbors,       \
+                             const SCALAR* distances, const size_t nbNeighbors, const double radius,  \
+                             const PROFILE& profile, double* top, double* bottom) {                    \
+            NAME##Pairs(e, center, neighbors, distances, nbNeighbors, radius, profile, top, bottom);   \
+        }                                                                                              \
+    };
+
+// Kernels are instantiated for the projections the elements are stored
+// with (normals are always preprocessed into projectors or codes).
+#define VARIFOLD_BATCH_KERNELS(NAME, PROFILE)                                                          \
+    VARIFOLD_BATCH_KERNEL(NAME##Axis, PROFILE, Projection::AxisWeights, double)                        \
+    VARIFOLD_BATCH_KERNEL(NAME##Projector, PROFILE, Projection::Projector, double)                     \
+    VARIFOLD_BATCH_KERNEL(NAME##Oct32, PROFILE, Projection::Octahedral32, double)                      \
+    VARIFOLD_BATCH_KERNEL(NAME##Oct48, PROFILE, Projection::Octahedral48, double)                      \
+    VARIFOLD_BATCH_KERNEL(NAME##AxisFloat, PROFILE, Projection::AxisWeights, float)                    \
+    VARIFOLD_BATCH_KERNEL(NAME##ProjectorFloat, PROFILE, Projection::Projector, float)                 \
+    VARIFOLD_BATCH_KERNEL(NAME##Oct32Float, PROFILE, Projection::Octahedral32, float)                  \
+    VARIFOLD_BATCH_KERNEL(NAME##Oct48Float, PROFILE, Projection::Octahedral48, float)
+
+VARIFOLD_BATCH_KERNELS(accumulateLinear, LinearProfile)
+VARIFOLD_BATCH_KERNELS(accumulatePolynomial, PolynomialProfile)
+VARIFOLD_BATCH_KERNELS(accumulateExponential, ExponentialProfile)
+VARIFOLD_BATCH_KERNELS(accumulateTabulated, TabulatedProfile)
+
+#undef VARIFOLD_BATCH_KERNELS
+#undef VARIFOLD_BATCH_KERNEL
+
+/// @return the instruction set the batched kernels run with on this machine.
+inline std::string instructionSet() {
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+    if (__builtin_cpu_supports("avx512f")) return "avx512f";
+    if (__builtin_cpu_supports("avx2")) return "avx2";
+#endif
+    return "scalar";
+}
+
+} // namespace VarifoldBatch
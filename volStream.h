@@ -0,0 +1,128 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <istream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "threadPool.h"
+
+/**
+ * @file volStream.h
+ *
+ * Streamed reading of `.vol` files: an ASCII header of "Key: value" lines
+ * ended by a line ".", followed by one byte per voxel, x varying first,
+ * then y, then z. The payload is read by blocks of z planes, so that it
+ * is never held in memory as a whole.
+ */
+
+struct VolHeader {
+    std::array<int, 3> sizes = {{0, 0, 0}};
+    std::map<std::string, std::string> fields;
+
+    size_t planeSize() const { return static_cast<size_t>(sizes[0]) * sizes[1]; }
+};
+
+/// Reads the header of a `.vol` stream, leaving \a in at the payload.
+/// @return false, with the reason in \a error, if the header is invalid
+/// or the payload is not raw (versions other than 2).
+inline bool readVolHeader(std::istream& in, VolHeader& header, std::string& error) {
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line == ".") break;
+        const auto colon = line.find(':');
+        if (colon == std::string::npos) {
+            error = "invalid header line \"" + line + "\"";
+            return false;
+        }
+        auto value = line.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(' '));
+        header.fields[line.substr(0, colon)] = value;
+    }
+    if (!in) {
+        error = "unterminated header";
+        return false;
+    }
+    const char* keys[] = {"X", "Y", "Z"};
+    for (auto d = 0; d < 3; ++d) {
+        const auto it = header.fields.find(keys[d]);
+        header.sizes[d] = it == header.fields.end() ? 0 : std::atoi(it->second.c_str());
+        if (header.sizes[d] <= 0) {
+            error = std::string("missing or invalid size ") + keys[d];
+            return false;
+        }
+    }
+    const auto version = header.fields.find("Version");
+    if (version != header.fields.end() && version->second != "2") {
+        error = "unsupported version " + version->second;
+        return false;
+    }
+    return true;
+}
+
+/// Calls `f(z0, z1, data)` on consecutive blocks [z0, z1) of at most \a
+/// planesPerBlock planes of the payload of \a in, positioned at plane \a
+/// begin, up to plane \a end. @return false if the stream ends early.
+template <typename F>
+bool streamVolPlanes(std::istream& in, const VolHeader& header, const int begin, const int end, const int planesPerBlock, const F& f) {
+    std::vector<unsigned char> block(header.planeSize() * planesPerBlock);
+    for (auto z0 = begin; z0 < end; z0 += planesPerBlock) {
+        const auto z1 = std::min(end, z0 + planesPerBlock);
+        const auto bytes = header.planeSize() * (z1 - z0);
+        if (!in.read(reinterpret_cast<char*>(block.data()), bytes)) return false;
+        f(z0, z1, block.data());
+    }
+    return true;
+}
+
+/// Bounding box of the foreground voxels of a volume, inclusive.
+struct VoxelBox {
+    std::array<int, 3> lower = {{0, 0, 0}};
+    std::array<int, 3> upper = {{-1, -1, -1}};
+
+    bool empty() const { return upper[0] < lower[0]; }
+
+    void extend(const VoxelBox& other) {
+        if (other.empty()) return;
+        if (empty()) {
+            *this = other;
+            return;
+        }
+        for (auto d = 0; d < 3; ++d) {
+            lower[d] = std::min(lower[d], other.lower[d]);
+            upper[d] = std::max(upper[d], other.upper[d]);
+        }
+    }
+};
+
+/// @return the bounding box of the voxels of the payload of \a in for
+/// which \a isForeground(value) holds. Blocks of planes are streamed and
+/// their rows scanned in parallel.
+template <typename Predicate>
+bool foregroundBox(std::istream& in, const VolHeader& header, const Predicate& isForeground, ThreadPool& pool, VoxelBox& box,
+                   const int planesPerBlock = 16) {
+    const auto nx = header.sizes[0], ny = header.sizes[1];
+    std::mutex mutex;
+    return streamVolPlanes(in, header, 0, header.sizes[2], planesPerBlock, [&](const int z0, const int z1, const unsigned char* data) {
+        pool.parallelFor(0, static_cast<size_t>(ny) * (z1 - z0), 64, [&](size_t begin, size_t end) {
+            VoxelBox local;
+            for (auto r = begin; r < end; ++r) {
+                const auto row = data + r * nx;
+                int x0 = 0, x1 = nx - 1;
+                while (x0 < nx && !isForeground(row[x0])) ++x0;
+                if (x0 == nx) continue;
+                while (!isForeground(row[x1])) --x1;
+                VoxelBox rowBox;
+                rowBox.lower = {{x0, static_cast<int>(r % ny), z0 + static_cast<int>(r / ny)}};
+                rowBox.upper = {{x1, rowBox.lower[1], rowBox.lower[2]}};
+                local.extend(rowBox);
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            box.extend(local);
+        });
+    });
+}